@@ -1,72 +1,122 @@
 #pragma once
 
+#include "fixed16.h"
+
+// Helpers so that VectorT and the code using it can be written once for any element type.
+inline float vector_abs(float f) { return fabsf(f); }
+inline int vector_abs(int i) { return (i < 0)?-i:i; }
+inline fixed16 vector_abs(fixed16 f) { return fixed16::from_raw((f.raw < 0)?-f.raw:f.raw); }
+
+inline float vector_sqrt(float f) { return sqrtf(f); }
+inline fixed16 vector_sqrt(fixed16 f)
+{
+	// Integer square root of the raw value, shifted up so the result is also 16.16.
+	if (f.raw <= 0)
+		return fixed16();
+	uint64_t value = uint64_t(f.raw) << 16;
+	uint64_t result = 0;
+	uint64_t bit = uint64_t(1) << 46;
+	while (bit > value)
+		bit >>= 2;
+	while (bit != 0)
+	{
+		if (value >= result + bit)
+		{
+			value -= result + bit;
+			result = (result >> 1) + bit;
+		}
+		else
+		{
+			result >>= 1;
+		}
+		bit >>= 2;
+	}
+	return fixed16::from_raw(int32_t(result));
+}
+
+inline size_t vector_print(Print& p, float f) { return p.print(f); }
+inline size_t vector_print(Print& p, int i) { return p.print(i); }
+inline size_t vector_print(Print& p, fixed16 f) { return p.print(float(f)); }
+
 // Simple vector class used to represent 2 and 3 component vectors in the sensor movement calculations.
-class Vector : public Printable
+template <typename T>
+class VectorT : public Printable
 {
 public:
-	float x;
-	float y;
-	float z;
+	T x;
+	T y;
+	T z;
 
-	Vector(float x = 0, float y = 0, float z = 0) 
-	: x(x), y(y), z(z) 
+	VectorT(T x = 0, T y = 0, T z = 0)
+	: x(x), y(y), z(z)
 	{}
-	
-	Vector(const Vector &other)
+
+	VectorT(const VectorT &other)
 	: x(other.x), y(other.y), z(other.z)
 	{}
 
-	void operator+=(const Vector &other)
+	// Converts from a vector with a different element type.
+	template <typename U>
+	explicit VectorT(const VectorT<U> &other)
+	: x(T(other.x)), y(T(other.y)), z(T(other.z))
+	{}
+
+	void operator+=(const VectorT &other)
 	{
 		x += other.x;
 		y += other.y;
 		z += other.z;
 	}
 
-	Vector operator+(const Vector &other) const
+	VectorT operator+(const VectorT &other) const
 	{
-		return Vector(x + other.x, y + other.y, z + other.z);
+		return VectorT(x + other.x, y + other.y, z + other.z);
 	}
 
-	Vector operator-() const
+	VectorT operator-() const
 	{
-		return Vector(-x, -y, -z);
+		return VectorT(-x, -y, -z);
 	}
 
-	Vector operator-(const Vector &other) const
+	VectorT operator-(const VectorT &other) const
 	{
-		return Vector(x - other.x, y - other.y, z - other.z);
+		return VectorT(x - other.x, y - other.y, z - other.z);
 	}
 
-	Vector operator*(float scale) const
+	VectorT operator*(T scale) const
 	{
-		return Vector(x * scale, y * scale, z * scale);
+		return VectorT(x * scale, y * scale, z * scale);
 	}
 
-	float dot(const Vector& other)
+	T dot(const VectorT& other)
 	{
 		return (x * other.x) + (y * other.y) + (z * other.z);
 	}
 
-	float mag(void)
+	T mag(void)
 	{
-		return sqrtf((x * x) + (y * y) + (z * z));
+		return vector_sqrt((x * x) + (y * y) + (z * z));
 	}
 
 	size_t printTo(Print& p) const
 	{
 		size_t n = 0;
 		n += p.print(F("("));
-		n += p.print(x);
+		n += vector_print(p, x);
 		n += p.print(F(", "));
-		n += p.print(y);
+		n += vector_print(p, y);
 		if (z != 0)
 		{
 			n += p.print(F(", "));
-			n += p.print(z);
+			n += vector_print(p, z);
 		}
 		n += p.print(F(")"));
 
 		return n;
 	}
 };
+
+typedef VectorT<float> Vector;
+
+// Whole sensor counts, as returned by adns::motion().
+typedef VectorT<int> CountVector;
@@ -0,0 +1,102 @@
+#include <math.h>
+
+#include "acceleration.h"
+
+static int32_t abs32(int32_t x)
+{
+  return (x < 0)?-x:x;
+}
+
+acceleration_curve::acceleration_curve()
+{
+  // Start out with no acceleration.
+  for (int i = 0; i <= table_size; i++)
+  {
+    table[i] = 65536;
+  }
+}
+
+float acceleration_curve::evaluate(const settings_t &settings, float speed)
+{
+  switch (settings.curve)
+  {
+    case linear:
+    default:
+      return settings.gain;
+
+    case power:
+    {
+      float gain = settings.gain * (1.0f + powf(speed / settings.speed, settings.shape));
+      return (gain > settings.cap)?settings.cap:gain;
+    }
+
+    case sigmoid:
+      return settings.gain + ((settings.cap - settings.gain) / (1.0f + expf((settings.speed - speed) / settings.shape)));
+
+    case points:
+    {
+      if (settings.point_count == 0)
+      {
+        return 1.0f;
+      }
+      const point_t *p = settings.point_list;
+      if (speed <= p[0].speed)
+      {
+        return p[0].gain;
+      }
+      for (int i = 1; i < settings.point_count; i++)
+      {
+        if (speed <= p[i].speed)
+        {
+          float t = (speed - p[i - 1].speed) / (p[i].speed - p[i - 1].speed);
+          return p[i - 1].gain + ((p[i].gain - p[i - 1].gain) * t);
+        }
+      }
+      return p[settings.point_count - 1].gain;
+    }
+  }
+}
+
+void acceleration_curve::set_curve(const settings_t &settings)
+{
+  const float step = float(1 << table_step_shift) / 256.0f;
+  for (int i = 0; i <= table_size; i++)
+  {
+    table[i] = int32_t(evaluate(settings, i * step) * 65536.0f + 0.5f);
+  }
+}
+
+int32_t acceleration_curve::gain(int32_t x, int32_t y, uint32_t interval_micros) const
+{
+  // Distance moved, with the "alpha max plus beta min" approximation (within about 6%), so this doesn't need a square root.
+  uint32_t big = abs32(x);
+  uint32_t small = abs32(y);
+  if (small > big)
+  {
+    uint32_t temp = big;
+    big = small;
+    small = temp;
+  }
+  uint64_t distance = ((uint64_t(big) * 15) / 16) + ((uint64_t(small) * 15) / 32);
+  if (distance < big)
+  {
+    distance = big;
+  }
+
+  // Speed in counts/ms, as 24.8 fixed point.
+  if (interval_micros == 0)
+  {
+    interval_micros = 1;
+  }
+  uint64_t speed = (distance * 1000) / (uint64_t(interval_micros) << 8);
+
+  uint32_t index = uint32_t(speed >> table_step_shift);
+  if (index >= table_size)
+  {
+    return table[table_size];
+  }
+  int32_t fraction = int32_t(speed & ((1 << table_step_shift) - 1));
+  int32_t low = table[index];
+  int32_t high = table[index + 1];
+  return low + int32_t((int64_t(high - low) * fraction) >> table_step_shift);
+}
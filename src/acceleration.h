@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+
+// Pointer acceleration: scales pointer motion by a gain that depends on how fast the ball is moving.
+//
+// The curve is worked out once (with float math) into a table of gains at evenly spaced speeds,
+// and each sample just looks up its speed in the table and interpolates, so there's no powf() or expf() per sample.
+// This matters on the SAMD21, where every float operation is a call into the software floating point library.
+//
+// Speeds are in counts per millisecond. At the usual 800 cpi, 1 count/ms is 1.25 inches per second.
+//
+// This doesn't depend on anything Arduino-specific, so it can be built on the host.
+class acceleration_curve
+{
+public:
+    enum curve_t
+    {
+        // gain, at every speed
+        linear,
+        // gain * (1 + (v / speed) ^ shape), up to cap. So the gain has doubled at speed.
+        power,
+        // Goes smoothly from gain at low speeds to cap at high speeds, halfway there at speed.
+        // shape is how spread out the change is, in counts/ms.
+        sigmoid,
+        // Straight lines between points. Before the first point and after the last, the gain stays the same.
+        points
+    };
+
+    struct point_t
+    {
+        float speed;
+        float gain;
+    };
+
+    struct settings_t
+    {
+        curve_t curve;
+        float gain;
+        float cap;
+        float speed;
+        float shape;
+        // For the points curve, sorted by speed.
+        const point_t *point_list;
+        int point_count;
+    };
+
+    // The table covers speeds up to table_size * table_step counts/ms. Anything faster gets the last gain in the table.
+    static const int table_size = 64;
+    static const int table_step_shift = 7;  // 0.5 counts/ms, as 24.8 fixed point
+
+    acceleration_curve();
+
+    // Rebuilds the table for a new curve. This uses float math, so it shouldn't happen per sample.
+    void set_curve(const settings_t &settings);
+
+    // Returns the gain (16.16 fixed point) for motion of (x, y) counts (16.16 fixed point) over interval_micros.
+    int32_t gain(int32_t x, int32_t y, uint32_t interval_micros) const;
+
+    // Evaluates the curve directly, with float math. set_curve() uses this to fill the table.
+    static float evaluate(const settings_t &settings, float speed);
+
+private:
+    // Gains (16.16 fixed point) at speeds of 0, table_step, 2 * table_step, ... table_size * table_step.
+    int32_t table[table_size + 1];
+};
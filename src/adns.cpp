@@ -5,6 +5,12 @@
 #include "Vector.h"
 #include "adns.h"
 
+#if ADNS_DMA_SROM
+  #include <hardware/clocks.h>
+  #include <hardware/dma.h>
+  #include <hardware/spi.h>
+#endif
+
 #ifdef ADNS_SUPPORT_ADNS9800
   #include "ADNS9800_firmware.h"
 #endif
@@ -70,20 +76,143 @@ enum
   REG_Pixel_Burst                          = 0x64,
 };
 
-// Delay times from the datasheet, in microseconds
+// Delay times from the datasheet which are the same for all supported sensors, in microseconds
 enum
 {
-    mcs_tSWW = 120,          // SPI time between write commands
-    mcs_tSWR = 120,          // SPI time between write and read commands
-    mcs_tSRW = 20,           // SPI time between read and subsequent commands
-    mcs_tSRR = 20,           // SPI time between read and subsequent commands
-    mcs_tSRAD = 100,         // SPI read address-data delay
     mcs_tSCLK_NCS_read = 1,  // SCLK to NCS inactive (for read operation) (actually 120 nanoseconds)
     mcs_tSCLK_NCS_write = 20, // SCLK to NCS inactive (for read operation)
-    mcs_tBEXIT = 1,           // NCS inactive after motion burst (actually 500 nanoseconds)
-    mcs_tSRAD_MOTBR = 35,      // From rising SCLK for last bit of the address byte, to falling SCLK for first bit of data being read. Applicable for Burst Mode Motion Read only.
+    mcs_tLOAD = 15,           // Time between bytes of an SROM download
+    mcs_max_gap = 255,        // Upper bound on any of the per-model delays in adns_timing
+};
+
+// SPI timing for a sensor model. Clocks are in Hz, delays are in microseconds.
+struct adns_timing
+{
+  uint32_t sclk_register;   // Maximum SCLK for register reads/writes
+  uint32_t sclk_burst;      // Maximum SCLK for motion bursts
+  uint32_t sclk_srom;       // SCLK for the SROM download
+  uint32_t sclk_image;      // SCLK for reading images
+  uint8_t tSWW;             // SPI time between write commands
+  uint8_t tSWR;             // SPI time between write and read commands
+  uint8_t tSRW;             // SPI time between read and subsequent write commands
+  uint8_t tSRR;             // SPI time between read and subsequent read commands
+  uint8_t tSRAD;            // SPI read address-data delay
+  uint8_t tSRAD_MOTBR;      // From rising SCLK for last bit of the address byte, to falling SCLK for first bit of data being read. Applicable for Burst Mode Motion Read only.
+  uint8_t tBEXIT;           // NCS inactive after motion burst (actually 500 nanoseconds)
+};
+
+// Used until we know which sensor we're talking to.
+// This uses the slowest clock and the longest delays of any supported model.
+static const adns_timing timing_default =
+{
+  200000, 200000, 2000000, 3200000,
+  180, 180, 20, 20, 160, 35, 1
 };
 
+// The image clock is faster than the datasheets say is allowed, but it works on the hardware I have.
+static const adns_timing timing_adns9800 =
+{
+  2000000, 2000000, 2000000, 3200000,
+  120, 120, 20, 20, 100, 35, 1
+};
+
+static const adns_timing timing_pmw3360dm =
+{
+  2000000, 2000000, 2000000, 3200000,
+  180, 180, 20, 20, 160, 35, 1
+};
+
+static const adns_timing timing_pmw3389dm =
+{
+  2000000, 2000000, 2000000, 3200000,
+  180, 180, 20, 20, 160, 35, 1
+};
+
+// Clocks tried by the SPI self-test, in increasing order.
+static const uint32_t self_test_clocks[] = { 200000, 500000, 1000000, 2000000 };
+
+// Everything the driver needs to know about a sensor model.
+// The CPI layout and image size come from the compile-time descriptions in adns.h.
+struct adns_model
+{
+  int product_id;
+  const char *name;
+  int cpi_step;
+  int cpi_max;
+  int cpi_registers;
+  int image_width;
+  const adns_timing *timing;
+  unsigned short firmware_length;
+  const uint8_t *firmware_data;
+};
+
+#ifdef ADNS_SUPPORT_ADNS9800
+// The ADNS-9800 datasheet says that the value of REG_Configuration_I specifies the resolution in units of 50 cpi,
+//     with a minimum of 0x01 (50 cpi) and a maximum of 0xA4 (8200cpi).
+static const adns_model model_adns9800 =
+{
+  adns_adns9800::product_id, "ADNS-9800",
+  adns_adns9800::cpi_step, adns_adns9800::cpi_max, adns_adns9800::cpi_registers,
+  adns_adns9800::image_width,
+  &timing_adns9800,
+  firmware_length_adns9800, firmware_data_adns9800
+};
+const adns_model &adns_adns9800::model() { return model_adns9800; }
+#endif
+
+#ifdef ADNS_SUPPORT_PMW3360DM
+// The pmw3360DM datasheet I have defines register 0x0F as "Config1", but does not specifically define allowable bit values.
+//     It does say that the chip has "selectable resolutions up to 12000cpi with 100cpi step size", and that the default value
+//     for the register is 0x31.
+static const adns_model model_pmw3360dm =
+{
+  adns_pmw3360dm::product_id, "PMW3360DM",
+  adns_pmw3360dm::cpi_step, adns_pmw3360dm::cpi_max, adns_pmw3360dm::cpi_registers,
+  adns_pmw3360dm::image_width,
+  &timing_pmw3360dm,
+  firmware_length_pmw3360dm, firmware_data_pmw3360dm
+};
+const adns_model &adns_pmw3360dm::model() { return model_pmw3360dm; }
+#endif
+
+#ifdef ADNS_SUPPORT_PMW3389DM
+// The pmw3389DM datasheet I have defines register 0x0F as "Resolution_L" and register 0x0E as "Resolution_H", and also does not
+//     define allowable values. It says that the chip has "selectable resolutions up to 16000CPI with 50CPI step size", and shows
+//     default values of 0x42 for Resolution_L and 0x0 for Resolution_H.
+//     16000 / 50 comes out to 320 (> 255), so it makes sense that they would need an additional 8 bit register for the full range.
+static const adns_model model_pmw3389dm =
+{
+  adns_pmw3389dm::product_id, "PMW3389DM",
+  adns_pmw3389dm::cpi_step, adns_pmw3389dm::cpi_max, adns_pmw3389dm::cpi_registers,
+  adns_pmw3389dm::image_width,
+  &timing_pmw3389dm,
+  firmware_length_pmw3389dm, firmware_data_pmw3389dm
+};
+const adns_model &adns_pmw3389dm::model() { return model_pmw3389dm; }
+#endif
+
+// Model lookup used by the generic driver.
+static const adns_model *find_supported_model(int product_id)
+{
+  switch(product_id)
+  {
+#ifdef ADNS_SUPPORT_ADNS9800
+    case adns::PID_adns9800:
+      return &model_adns9800;
+#endif
+#ifdef ADNS_SUPPORT_PMW3360DM
+    case adns::PID_pmw3360dm:
+      return &model_pmw3360dm;
+#endif
+#ifdef ADNS_SUPPORT_PMW3389DM
+    case adns::PID_pmw3389dm:
+      return &model_pmw3389dm;
+#endif
+    default:
+      return NULL;
+  }
+}
+
 enum
 {
   chip_state_uninitialized = 0,
@@ -91,38 +220,95 @@ enum
   chip_state_image_capture = 2
 };
 
-static inline int bytes2int(byte h, byte l)
+enum
 {
-  int result = (int8_t)h;
-  result *= 256;
-  result += l;
-  return result;
-}
+  burst_idle = 0,
+  burst_in_flight = 1,
+  burst_complete = 2
+};
+
+// The sensor (if any) which has left its chip select asserted, either for a motion burst DMA or 
+// for a queued register read waiting out tSRAD.
+// Any other transaction has to wait for that one to finish before it can assert its chip select.
+static adns *bus_owner = NULL;
+
+// Instances using a motion pin, indexed by the interrupt handler they're attached to.
+// attachInterrupt() doesn't pass any context to the handler, so each slot gets its own small handler.
+#define ADNS_MAX_MOTION_PINS 4
+static adns *motion_pin_sensors[ADNS_MAX_MOTION_PINS] = { NULL };
+
+static void motion_pin_isr0() { motion_pin_sensors[0]->motion_interrupt(); }
+static void motion_pin_isr1() { motion_pin_sensors[1]->motion_interrupt(); }
+static void motion_pin_isr2() { motion_pin_sensors[2]->motion_interrupt(); }
+static void motion_pin_isr3() { motion_pin_sensors[3]->motion_interrupt(); }
+static void (* const motion_pin_isrs[ADNS_MAX_MOTION_PINS])() = 
+{
+  motion_pin_isr0, motion_pin_isr1, motion_pin_isr2, motion_pin_isr3
+};
+
+// Bytes clocked out while reading the motion burst.
+static const byte burst_zeros[adns_burst::size] = { 0 };
 
 #define CLAMP(val, min, max) (val > max)?max:((val < min)?min:val)
 
 static const uint32_t bitrate = 200000;
 
+// Each call to firmware_upload_step() sends SROM bytes for at most this long before returning.
+static const unsigned long srom_slice_micros = 1000;
+
+enum
+{
+  init_idle = 0,
+  init_reset,
+  init_reset_wait,
+  init_reset_flush,
+  init_flush_wait,
+  init_probe,
+  init_probe_wait,
+  init_self_test,
+  init_upload,
+  init_configure,
+  init_settle,
+  init_capture,
+  init_done,
+  init_failed
+};
+
+enum
+{
+  upload_idle = 0,
+  upload_frame_wait,
+  upload_enable,
+  upload_streaming,
+  upload_streaming_dma,
+  upload_verify,
+  upload_verify_read,
+  upload_crc_wait,
+  upload_crc_upper_read,
+  upload_crc_lower_read,
+  upload_done,
+  upload_failed
+};
+
 adns::adns(int8_t ncs, int report_cpi)
-    : report_cpi(report_cpi)
-#if !defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
-    , ncs(ncs)
-    , settings(bitrate, MSBFIRST, SPI_MODE3)
-#endif
+    : adns(ncs, report_cpi, SPI, -1, find_supported_model)
 {  
-#if defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
-  spi_dev = new Adafruit_SPIDevice(ncs, bitrate, SPI_BITORDER_MSBFIRST, SPI_MODE3);
-#else
-  spi_dev = &SPI;
-#endif
-  common_construct();
 }
 
 adns::adns(int8_t ncs, int report_cpi, SPIClass &spi)
+    : adns(ncs, report_cpi, spi, -1, find_supported_model)
+{
+}
+
+adns::adns(int8_t ncs, int report_cpi, SPIClass &spi, int8_t motion)
+    : adns(ncs, report_cpi, spi, motion, find_supported_model)
+{
+}
+
+adns::adns(int8_t ncs, int report_cpi, SPIClass &spi, int8_t motion, model_lookup lookup)
     : report_cpi(report_cpi)
 #if !defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
     , ncs(ncs)
-    , settings(bitrate, MSBFIRST, SPI_MODE3)
 #endif
 {
 #if defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
@@ -130,16 +316,22 @@ adns::adns(int8_t ncs, int report_cpi, SPIClass &spi)
 #else
   spi_dev = &spi;
 #endif
-  common_construct();
+  common_construct(lookup);
+  motion_pin = motion;
 }
 
 #if defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
 adns::adns(int8_t ncs, int report_cpi, int8_t sck, int8_t miso, int8_t mosi)
+    : adns(ncs, report_cpi, sck, miso, mosi, find_supported_model)
+{
+}
+
+adns::adns(int8_t ncs, int report_cpi, int8_t sck, int8_t miso, int8_t mosi, model_lookup lookup)
     : report_cpi(report_cpi)
 {
   // Software SPI seems to want a slower clock to function correctly?
   spi_dev = new Adafruit_SPIDevice(ncs, sck, miso, mosi, 100000, SPI_BITORDER_MSBFIRST, SPI_MODE3);
-  common_construct();
+  common_construct(lookup);
 }
 #endif
 
@@ -147,17 +339,50 @@ adns::adns(void)
     : report_cpi(0)
 #if !defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
     , ncs(-1)
-    , settings(bitrate, MSBFIRST, SPI_MODE3)
 #endif
 {
   spi_dev = NULL;
-  common_construct();
+  // A dummy instance never finds a sensor, so it doesn't need to know about any.
+  common_construct(NULL);
 }
 
-void adns::common_construct()
+void adns::common_construct(model_lookup lookup)
 {
   chip_state = chip_state_uninitialized;
   product_id = PID_unknown;
+  find_model = lookup;
+  model = NULL;
+  burst_state = burst_idle;
+  burst_callback = NULL;
+  ready_at = 0;
+  reg_queue_head = 0;
+  reg_queue_count = 0;
+  reg_read_pending = false;
+  pending_cpi = 0;
+  current_cpi = 0;
+  cpi_scale_q16 = 0;
+  cpi_blend = false;
+  previous_scale_q16 = 0;
+  cpi_change_micros = 0;
+  burst_micros = 0;
+  previous_burst_micros = 0;
+  remainder_x = 0;
+  remainder_y = 0;
+  upload_state = upload_idle;
+  upload_micros = 0;
+  init_state = init_idle;
+  init_due = 0;
+  capture_pending = false;
+  restore_cpi = 0;
+  queued_value = 0;
+  self_test_index = -1;
+  self_test_passed = true;
+  self_test_good_clock = 0;
+  upload_crc_upper = 0;
+  motion_pin = -1;
+  motion_signaled = false;
+  timing = &timing_default;
+  spi_clock = timing->sclk_register;
 }
 
 adns::~adns()
@@ -170,11 +395,23 @@ adns::~adns()
 }
 
 bool adns::init ()
+{
+  begin_init();
+  while (!init_step())
+  {
+    yield();
+  }
+
+  return initialized();
+}
+
+void adns::begin_init()
 {
   if (!spi_dev)
   {
     debugLogger.printf("adns::init: dummy device\n");
-    return false;
+    init_state = init_failed;
+    return;
   }
 
 #if !defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
@@ -184,74 +421,327 @@ bool adns::init ()
 
   spi_dev->begin();
 
+  if (motion_pin >= 0)
+  {
+    attach_motion_pin();
+  }
+
   chip_state = chip_state_uninitialized;
+  init_state = init_reset;
+
+  // Until the product ID has been read, use the conservative timing.
+  model = NULL;
+  timing = &timing_default;
+  spi_clock = timing->sclk_register;
+}
 
-  reset();
+void adns::attach_motion_pin()
+{
+  // The motion pin is active-low. It's asserted when the sensor has motion to report, and released when the motion is read.
+  pinMode(motion_pin, INPUT_PULLUP);
+  for (int i = 0; i < ADNS_MAX_MOTION_PINS; i++)
+  {
+    if (motion_pin_sensors[i] == this)
+    {
+      // Already attached (init may be called more than once)
+      return;
+    }
+  }
+  for (int i = 0; i < ADNS_MAX_MOTION_PINS; i++)
+  {
+    if (motion_pin_sensors[i] == NULL)
+    {
+      motion_pin_sensors[i] = this;
+      attachInterrupt(digitalPinToInterrupt(motion_pin), motion_pin_isrs[i], FALLING);
+      debugLogger.printf("Using motion pin %d\n", int(motion_pin));
+      return;
+    }
+  }
+  // Out of handler slots. Fall back to polling.
+  debugLogger.printf("*** No interrupt slot for motion pin %d, polling instead ***\n", int(motion_pin));
+  motion_pin = -1;
+}
 
-  // Read the product ID, so we know which firmware to use.
-  product_id = read_reg(REG_Product_ID);
-  debugLogger.printf("Read product id: 0x%02x\n", int(product_id));
-  delay(1);
+void adns::motion_interrupt()
+{
+  motion_signaled = true;
+}
 
-  // upload the firmware
-  if (!upload_firmware())
+bool adns::motion_pending()
+{
+  if (motion_pin < 0)
   {
-    return false;
+    // Without a motion pin, there's no way to tell without polling.
+    return true;
   }
+  // The interrupt catches short pulses, the level covers motion that's still waiting to be read.
+  return motion_signaled || (digitalRead(motion_pin) == LOW);
+}
 
-  enable_laser();
+bool adns::init_step()
+{
+  if ((init_state == init_done) || (init_state == init_failed) || (init_state == init_idle))
+  {
+    return true;
+  }
 
-  debugLogger.printf("Chip initialized\n");
+  if ((long)(millis() - init_due) < 0)
+  {
+    // Still waiting
+    return false;
+  }
 
-  // By default, run the sensor at its maximum CPI value.  
-  switch(product_id)
+  if (bus_owner && bus_owner != this)
+  {
+    // Another sensor on this bus is in the middle of something (probably its own firmware upload). 
+    // Come back once it's done.
+    return false;
+  }
+
+  switch (init_state)
   {
-    case PID_adns9800:
-      set_cpi(8200);
+    case init_reset:
+      begin_reset();
+      init_state = init_reset_wait;
+    break;
+
+    case init_reset_wait:
+      if (!service())
+      {
+        break;
+      }
+      // wait for it to reboot
+      init_due = millis() + 50;
+      init_state = init_reset_flush;
+    break;
+
+    case init_reset_flush:
+      finish_reset();
+      init_state = init_flush_wait;
+    break;
+
+    case init_flush_wait:
+      if (!service())
+      {
+        break;
+      }
+      init_due = millis() + 50;
+      init_state = init_probe;
+    break;
+
+    case init_probe:
+      if (capture_pending && model != NULL)
+      {
+        // For image capture, the sensor runs without its firmware. It just needs the laser turned on.
+        enable_laser();
+        init_state = init_capture;
+        break;
+      }
+
+      // Read the product ID, so we know which firmware to use.
+      queue_read(REG_Product_ID, store_value);
+      init_state = init_probe_wait;
+    break;
+
+    case init_probe_wait:
+      if (!service())
+      {
+        break;
+      }
+      product_id = queued_value;
+      debugLogger.printf("Read product id: 0x%02x\n", int(product_id));
+      model = find_model?find_model(product_id):NULL;
+
+      // Now that we know what it is, talk to it as fast as it allows.
+      select_timing();
+      init_state = init_self_test;
     break;
-    case PID_pmw3360dm:
-      set_cpi(12000);
+
+    case init_self_test:
+      if (!self_test_step())
+      {
+        break;
+      }
+
+      // upload the firmware
+      if (!begin_firmware_upload())
+      {
+        init_state = init_failed;
+        break;
+      }
+      init_state = init_upload;
     break;
-    case PID_pmw3389dm:
-      set_cpi(16000);
+
+    case init_upload:
+      if (!firmware_upload_step())
+      {
+        break;
+      }
+      if (upload_state != upload_done)
+      {
+        init_state = init_failed;
+        break;
+      }
+
+      enable_laser();
+
+      debugLogger.printf("Chip initialized\n");
+
+      // By default, run the sensor at its maximum CPI value.
+      // Coming back from image capture, go back to whatever it was before.
+      set_cpi((restore_cpi > 0)?restore_cpi:model->cpi_max);
+      restore_cpi = 0;
+      init_state = init_configure;
     break;
+
+    case init_configure:
+      // Make sure the sensor is at the right CPI before it starts reporting.
+      if (!service())
+      {
+        break;
+      }
+
+      dispRegisters();
+
+      init_due = millis() + 100;
+      init_state = init_settle;
+    break;
+
+    case init_settle:
+      if (capture_pending)
+      {
+        // begin_image_capture() was called while this was in progress. Now that the model is known, start over.
+        init_state = init_reset;
+        break;
+      }
+      chip_state = chip_state_motion;
+      init_state = init_done;
+    break;
+
+    case init_capture:
+      if (!service())
+      {
+        break;
+      }
+      capture_pending = false;
+      chip_state = chip_state_image_capture;
+      init_state = init_done;
+    break;
+
     default:
     break;
   }
 
+  return (init_state == init_done) || (init_state == init_failed);
+}
 
-  delay(1);
-  
-  dispRegisters();
-  
-  delay(100);
+bool adns::initialized()
+{
+  return chip_state == chip_state_motion;
+}
 
-  chip_state = chip_state_motion;
+bool adns::failed()
+{
+  return init_state == init_failed;
+}
 
+void adns::select_timing()
+{
+  timing = model?model->timing:&timing_default;
+
+  // Step the clock up until reading back the product ID stops working reliably, or we hit the datasheet maximum.
+  // self_test_step() does the reads.
+  self_test_good_clock = spi_clock;
+  self_test_index = -1;
+}
+
+bool adns::self_test_step()
+{
+#if !defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
+  if (!service())
+  {
+    // Still reading
+    return false;
+  }
+
+  if (self_test_index >= 0)
+  {
+    // The reads at self_test_clocks[self_test_index] have all come back.
+    if (!self_test_passed)
+    {
+      debugLogger.printf("SPI self-test failed at %lu Hz\n", (unsigned long)spi_clock);
+      spi_clock = self_test_good_clock;
+      debugLogger.printf("SPI clock: %lu Hz\n", (unsigned long)spi_clock);
+      return true;
+    }
+    self_test_good_clock = spi_clock;
+  }
+
+  self_test_index++;
+  if ((self_test_index < int(sizeof(self_test_clocks) / sizeof(self_test_clocks[0]))) && 
+      (self_test_clocks[self_test_index] <= timing->sclk_register))
+  {
+    // The queue is empty, so all of these reads go out at this clock.
+    spi_clock = self_test_clocks[self_test_index];
+    self_test_passed = true;
+    for (int j = 0; j < 4; j++)
+    {
+      queue_read(REG_Product_ID, check_self_test);
+      queue_read(REG_Inverse_Product_ID, check_self_test);
+    }
+    return false;
+  }
+  spi_clock = self_test_good_clock;
+#endif
+
+  debugLogger.printf("SPI clock: %lu Hz\n", (unsigned long)spi_clock);
   return true;
 }
 
-void adns::reset()
+void adns::check_self_test(adns &sensor, byte reg, byte value)
 {
-  if (!spi_dev)
+  byte expected = (reg == REG_Product_ID)?byte(sensor.product_id):byte(~sensor.product_id);
+  if (value != expected)
   {
-      return;
+    sensor.self_test_passed = false;
   }
+}
+
+void adns::store_value(adns &sensor, byte reg, byte value)
+{
+  sensor.queued_value = value;
+}
+
+void adns::begin_reset()
+{
+  // Don't pull the chip select out from under a transaction that's still in progress.
+  release_bus();
+  burst_state = burst_idle;
+
+  // Anything still queued was meant for the chip as it was before the reset.
+  reg_queue_count = 0;
+  pending_cpi = current_cpi;
 
   com_end(); // ensure that the SPI port is reset
   com_begin(); // ensure that the SPI port is reset
   com_end(); // ensure that the SPI port is reset
-  write_reg(REG_Power_Up_Reset, 0x5a); // force reset
-  delay(50); // wait for it to reboot
+  queue_write(REG_Power_Up_Reset, 0x5a); // force reset
+}
 
+void adns::finish_reset()
+{
   // read registers 0x02 to 0x06 (and discard the data)
-  read_reg(REG_Motion);
-  read_reg(REG_Delta_X_L);
-  read_reg(REG_Delta_X_H);
-  read_reg(REG_Delta_Y_L);
-  read_reg(REG_Delta_Y_H);
+  queue_read(REG_Motion, NULL);
+  queue_read(REG_Delta_X_L, NULL);
+  queue_read(REG_Delta_X_H, NULL);
+  queue_read(REG_Delta_Y_L, NULL);
+  queue_read(REG_Delta_Y_H, NULL);
+}
 
-  delay(50);
+// Second half of enable_laser(), once the register value has been read.
+static void write_laser_ctrl0(adns &sensor, byte reg, byte value)
+{
+  sensor.queue_write(reg, value & 0xf0);
 }
 
 void adns::enable_laser()
@@ -263,26 +753,61 @@ void adns::enable_laser()
     // reading the actual value of the register is important because the real
     // default value is different from what is said in the datasheet, and if you
     // change the reserved bytes (like by writing 0x00...) it would not work.
-    byte laser_ctrl0 = read_reg(REG_LASER_CTRL0);
-    write_reg(REG_LASER_CTRL0, laser_ctrl0 & 0xf0 );  
+    queue_read(REG_LASER_CTRL0, write_laser_ctrl0);
   }
 }
 
-void adns::com_begin(bool fast)
+void adns::com_begin(uint32_t clock)
 {
+  if (bus_owner)
+  {
+    // Another transaction is still using the bus. Let it finish before touching any chip selects.
+    bus_owner->release_bus();
+  }
+
+  // Wait out whatever remains of the gap required after the previous transaction.
+  unsigned long remaining = ready_wait();
+  if (remaining > 0)
+  {
+    delayMicroseconds(remaining);
+  }
+
 #if defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
   spi_dev->beginTransactionWithAssertingCS();
 #else
-  if (fast)
+  spi_dev->beginTransaction(SPISettings((clock != 0)?clock:spi_clock, MSBFIRST, SPI_MODE3));
+  digitalWrite(ncs, LOW);
+#endif
+}
+
+unsigned long adns::ready_wait()
+{
+  // Returns the number of microseconds until this sensor is ready for another transaction.
+  // The upper bound keeps a stale timestamp (after micros() wraps) from causing a long wait.
+  unsigned long remaining = ready_at - micros();
+  return (remaining <= mcs_max_gap)?remaining:0;
+}
+
+bool adns::uploading()
+{
+  return (upload_state == upload_streaming) || (upload_state == upload_streaming_dma);
+}
+
+void adns::release_bus()
+{
+  // Finish whatever transaction this sensor left in progress.
+  while (uploading())
   {
-      spi_dev->beginTransaction(SPISettings(3200000, MSBFIRST, SPI_MODE3));
+    firmware_upload_step();
   }
-  else
+  if (burst_state == burst_in_flight)
   {
-    spi_dev->beginTransaction(settings);
+    finish_motion_burst();
+  }
+  if (reg_read_pending)
+  {
+    complete_queued_read();
   }
-  digitalWrite(ncs, LOW);
-#endif
 }
 
 void adns::com_end()
@@ -301,13 +826,14 @@ byte adns::read_reg(byte reg_addr)
   
   // send adress of the register, with MSBit = 0 to indicate it's a read
   spi_dev->transfer(reg_addr & 0x7f );
-  delayMicroseconds(mcs_tSRAD);
+  delayMicroseconds(timing->tSRAD);
   // read data
   byte data = spi_dev->transfer(0);
   
   delayMicroseconds(mcs_tSCLK_NCS_read);
   com_end();
-  delayMicroseconds(mcs_tSRW - mcs_tSCLK_NCS_read);
+  // The next command may be either a read or a write, so wait for the longer of the two.
+  ready_at = micros() + (((timing->tSRW > timing->tSRR)?timing->tSRW:timing->tSRR) - mcs_tSCLK_NCS_read);
 
   // This is too spammy during normal use, but can be useful when debugging sensor issues.
   if (0)
@@ -335,210 +861,676 @@ void adns::write_reg(byte reg_addr, byte data)
   
   delayMicroseconds(mcs_tSCLK_NCS_write); // tSCLK-NCS for write operation
   com_end();
-  delayMicroseconds(mcs_tSWW - mcs_tSCLK_NCS_write); // Could be shortened, but is looks like a safe lower bound 
+  // Rather than spinning here, record when the next transaction may start and let com_begin() wait if it needs to.
+  ready_at = micros() + (((timing->tSWW > timing->tSWR)?timing->tSWW:timing->tSWR) - mcs_tSCLK_NCS_write); // Could be shortened, but is looks like a safe lower bound 
+}
+
+bool adns::queue_write(byte reg, byte data, register_callback callback)
+{
+  if (reg_queue_count >= reg_queue_size)
+  {
+    return false;
+  }
+  reg_op &op = reg_queue[(reg_queue_head + reg_queue_count) % reg_queue_size];
+  op.reg = reg;
+  op.data = data;
+  op.write = true;
+  op.callback = callback;
+  reg_queue_count++;
+  return true;
+}
+
+bool adns::queue_read(byte reg, register_callback callback)
+{
+  if (reg_queue_count >= reg_queue_size)
+  {
+    return false;
+  }
+  reg_op &op = reg_queue[(reg_queue_head + reg_queue_count) % reg_queue_size];
+  op.reg = reg;
+  op.data = 0;
+  op.write = false;
+  op.callback = callback;
+  reg_queue_count++;
+  return true;
+}
+
+bool adns::service()
+{
+  if (reg_read_pending)
+  {
+    if ((long)(micros() - reg_read_due) < 0)
+    {
+      // Still waiting out tSRAD
+      return false;
+    }
+    complete_queued_read();
+  }
+
+  if (reg_queue_count == 0)
+  {
+    return true;
+  }
+
+  if (!spi_dev)
+  {
+    // Dummy device, just drop everything.
+    reg_queue_count = 0;
+    return true;
+  }
+
+  if (ready_wait() > 0 || (bus_owner && bus_owner != this))
+  {
+    // Either the sensor still needs time after the last transaction, or another sensor is using the bus.
+    // Try again next time.
+    return false;
+  }
+
+  reg_op &op = reg_queue[reg_queue_head];
+  if (op.write)
+  {
+    reg_op done = op;
+    reg_queue_head = (reg_queue_head + 1) % reg_queue_size;
+    reg_queue_count--;
+
+    write_reg(done.reg, done.data);
+    if (done.callback)
+    {
+      done.callback(*this, done.reg, done.data);
+    }
+  }
+  else
+  {
+    // Send the address, then leave the chip select asserted until tSRAD has passed.
+    com_begin();
+    spi_dev->transfer(op.reg & 0x7f);
+    reg_read_due = micros() + timing->tSRAD;
+    reg_read_pending = true;
+    bus_owner = this;
+  }
+
+  return (reg_queue_count == 0);
+}
+
+void adns::complete_queued_read()
+{
+  if (!reg_read_pending)
+  {
+    return;
+  }
+
+  long remaining = reg_read_due - micros();
+  if (remaining > 0)
+  {
+    delayMicroseconds(remaining);
+  }
+
+  byte data = spi_dev->transfer(0);
+  delayMicroseconds(mcs_tSCLK_NCS_read);
+  com_end();
+  // The next command may be either a read or a write, so wait for the longer of the two.
+  ready_at = micros() + (((timing->tSRW > timing->tSRR)?timing->tSRW:timing->tSRR) - mcs_tSCLK_NCS_read);
+
+  reg_read_pending = false;
+  if (bus_owner == this)
+  {
+    bus_owner = NULL;
+  }
+
+  // Pop the op before calling back, in case the callback queues more work.
+  reg_op op = reg_queue[reg_queue_head];
+  reg_queue_head = (reg_queue_head + 1) % reg_queue_size;
+  reg_queue_count--;
+
+  if (op.callback)
+  {
+    op.callback(*this, op.reg, data);
+  }
+}
+
+void adns::flush()
+{
+  while (!service())
+  {
+    yield();
+  }
 }
 
 bool adns::upload_firmware()
+{
+  if (!begin_firmware_upload())
+  {
+    return false;
+  }
+
+  while (!firmware_upload_step())
+  {
+    yield();
+  }
+
+  return (upload_state == upload_done);
+}
+
+bool adns::begin_firmware_upload()
 {  
   // send the firmware to the chip, cf p.18 of the datasheet
 
-  unsigned short firmware_length;
-  const uint8_t *firmware_data;
-  switch(product_id)
+  if (model == NULL)
   {
-#ifdef ADNS_SUPPORT_ADNS9800
-    case PID_adns9800:
-      debugLogger.printf("Uploading ADNS-9800 firmware\n");
-      firmware_length = firmware_length_adns9800;
-      firmware_data = firmware_data_adns9800;
+    debugLogger.printf("*** No firmware available for this chip! ***\n");
+    upload_state = upload_failed;
+    return false;
+  }
 
-      // set the configuration_IV register in 3k firmware mode
-      write_reg(REG_Configuration_IV, 0x02); // bit 1 = 1 for 3k mode, other bits are reserved 
+  debugLogger.printf("Uploading %s firmware\n", model->name);
+  if (product_id == PID_adns9800)
+  {
+    // set the configuration_IV register in 3k firmware mode
+    queue_write(REG_Configuration_IV, 0x02); // bit 1 = 1 for 3k mode, other bits are reserved 
+  }
+  else
+  {
+    // Write 0 to Rest_En bit of Config2 register to disable Rest mode.
+    queue_write(REG_Configuration_II, 0x20);
+  }
+
+  srom_data = model->firmware_data;
+  srom_length = model->firmware_length;
+  srom_offset = 0;
+  upload_started = micros();
+
+  // write 0x1d in SROM_enable reg for initializing
+  queue_write(REG_SROM_Enable, 0x1d); 
+  
+  // wait for more than one frame period
+  // (assume that the frame rate is as low as 100fps... even if it should never be that low)
+  upload_state = upload_frame_wait;
+  upload_due = millis() + 10;
+
+  return true;
+}
+
+bool adns::firmware_upload_step()
+{
+  switch (upload_state)
+  {
+    case upload_frame_wait:
+      if (!service())
+      {
+        // The frame wait starts once the writes have gone out.
+        upload_due = millis() + 10;
+        break;
+      }
+      if ((long)(millis() - upload_due) < 0)
+      {
+        break;
+      }
+
+      // write 0x18 to SROM_enable to start SROM download
+      queue_write(REG_SROM_Enable, 0x18); 
+      upload_state = upload_enable;
     break;
+
+    case upload_enable:
+      if (!service() || (ready_wait() > 0))
+      {
+        break;
+      }
+
+      // write the SROM file (=firmware data) 
+      com_begin(timing->sclk_srom);
+      spi_dev->transfer(REG_SROM_Load_Burst | 0x80); // write burst destination adress
+      // The chip select stays asserted until the whole image has been sent, so nothing else can use the bus until then.
+      bus_owner = this;
+      srom_next_byte = micros() + mcs_tLOAD;
+      upload_state = upload_streaming;
+
+#if ADNS_DMA_SROM
+      if (srom_dma_begin())
+      {
+        upload_state = upload_streaming_dma;
+      }
 #endif
-#ifdef ADNS_SUPPORT_PMW3360DM
-    case PID_pmw3360dm:
-      debugLogger.printf("Uploading PMW3360DM firmware\n");
-      firmware_length = firmware_length_pmw3360dm;
-      firmware_data = firmware_data_pmw3360dm;
+    break;
 
-      // Write 0 to Rest_En bit of Config2 register to disable Rest mode.
-      write_reg(REG_Configuration_II, 0x20);
+    case upload_streaming:
+    {
+      // Send bytes until this step has used up its time slice, so the caller gets control back regularly.
+      unsigned long slice_start = micros();
+      while ((srom_offset < srom_length) && (micros() - slice_start < srom_slice_micros))
+      {
+        // The datasheet asks for at least 15us between bytes. Rather than adding that after each transfer, 
+        // wait until the deadline set by the previous byte.
+        while ((long)(micros() - srom_next_byte) < 0) {}
+        spi_dev->transfer((unsigned char)pgm_read_byte(srom_data + srom_offset));
+        srom_next_byte = micros() + mcs_tLOAD;
+        srom_offset++;
+      }
+
+      if (srom_offset >= srom_length)
+      {
+        end_firmware_stream();
+      }
+    }
     break;
-#endif
-#ifdef ADNS_SUPPORT_PMW3389DM
-    case PID_pmw3389dm:
-      debugLogger.printf("Uploading PMW3389DM firmware\n");
-      firmware_length = firmware_length_pmw3389dm;
-      firmware_data = firmware_data_pmw3389dm;
 
-      // Write 0 to Rest_En bit of Config2 register to disable Rest mode.
-      write_reg(REG_Configuration_II, 0x20);
+#if ADNS_DMA_SROM
+    case upload_streaming_dma:
+      if (srom_dma_finished())
+      {
+        srom_offset = srom_length;
+        end_firmware_stream();
+      }
     break;
 #endif
 
+    case upload_verify:
+      if ((long)(micros() - upload_due) < 0)
+      {
+        break;
+      }
+      queue_read(REG_SROM_ID, store_value);
+      upload_state = upload_verify_read;
+    break;
+
+    case upload_verify_read:
+      if (!service())
+      {
+        break;
+      }
+      // The SROM_ID register reads as zero until the uploaded firmware is running.
+      if (queued_value == 0 && (millis() - upload_poll_started < 10))
+      {
+        upload_due = micros() + 1000;
+        upload_state = upload_verify;
+        break;
+      }
+
+      // SROM CRC test
+      queue_write(REG_SROM_Enable, 0x15); 
+      upload_state = upload_crc_wait;
+      upload_poll_started = millis();
+      upload_due = micros() + 1000;
+    break;
+
+    case upload_crc_wait:
+      if (!service() || (long)(micros() - upload_due) < 0)
+      {
+        break;
+      }
+      queue_read(REG_Data_Out_Upper, store_value);
+      upload_state = upload_crc_upper_read;
+    break;
+
+    case upload_crc_upper_read:
+      if (!service())
+      {
+        break;
+      }
+      // The datasheet says to wait 10ms for the CRC test, but the result usually shows up sooner. 
+      // The result registers read as zero until it does.
+      if (queued_value == 0 && (millis() - upload_poll_started < 10))
+      {
+        upload_due = micros() + 1000;
+        upload_state = upload_crc_wait;
+        break;
+      }
+      upload_crc_upper = queued_value;
+      queue_read(REG_Data_Out_Lower, store_value);
+      upload_state = upload_crc_lower_read;
+    break;
+
+    case upload_crc_lower_read:
+    {
+      if (!service())
+      {
+        break;
+      }
+      int upper = upload_crc_upper;
+      int lower = queued_value;
+      // The datasheet doesn't specify what the expected value for a successful CRC test is.
+      // A successful test on the 3360 seems to return the value 0xbeef.
+      debugLogger.printf("SROM CRC test result: 0x%02x%02x\n", upper, lower);
+
+      // These are queued, so they go out ahead of the CPI writes that follow the upload.
+      switch(product_id)
+      {
+        case PID_pmw3360dm:
+          // Read the SROM_ID register to verify the ID before any other register reads or writes.
+          queue_read(REG_SROM_ID, NULL);
+
+          // Write 0x00 to Config2 register for wired mouse or 0x20 for wireless mouse design.
+          queue_write(REG_Configuration_II, 0x00);
+
+          // set initial CPI resolution
+          // We do this later, using set_cpi().
+          // write_reg(REG_Configuration_I, 0x15);
+        break;
+
+        case PID_pmw3389dm:
+          // Read the SROM_ID register to verify the ID before any other register reads or writes.
+          queue_read(REG_SROM_ID, NULL);
+
+          // Write 0x00 to Config2 register for wired mouse or 0x20 for wireless mouse design.
+          queue_write(REG_Configuration_II, 0x00);
+
+          // set initial CPI resolution
+          // We do this later, using set_cpi().
+          // write_reg(REG_Configuration_I, 0x15);
+        break;
+      }
+
+      upload_micros = micros() - upload_started;
+      debugLogger.printf("Firmware upload took %lu us\n", upload_micros);
+      upload_state = upload_done;
+    }
+    break;
+
     default:
-      debugLogger.printf("*** No firmware available for this chip! ***\n");
-      return false;
     break;
   }
-  
-  // write 0x1d in SROM_enable reg for initializing
-  write_reg(REG_SROM_Enable, 0x1d); 
-  
-  // wait for more than one frame period
-  delay(10); // assume that the frame rate is as low as 100fps... even if it should never be that low
-  
-  // write 0x18 to SROM_enable to start SROM download
-  write_reg(REG_SROM_Enable, 0x18); 
-  
-  // write the SROM file (=firmware data) 
-  com_begin();
-  spi_dev->transfer(REG_SROM_Load_Burst | 0x80); // write burst destination adress
-  delayMicroseconds(15);
-  
-  // send all bytes of the firmware
-  unsigned char c;
-  for(unsigned int i = 0; i < firmware_length; i++)
-  { 
-    c = (unsigned char)pgm_read_byte(firmware_data + i);
-    spi_dev->transfer(c);
-    delayMicroseconds(15);
-  }
 
+  return (upload_state == upload_done) || (upload_state == upload_failed);
+}
+
+void adns::end_firmware_stream()
+{
   com_end();
+  if (bus_owner == this)
+  {
+    bus_owner = NULL;
+  }
 
-  delay(10);
-
-#if 1
-  // SROM CRC test
-  write_reg(REG_SROM_Enable, 0x15); 
-  delay(10);
-  int upper = read_reg(REG_Data_Out_Upper);
-  int lower = read_reg(REG_Data_Out_Lower);
-  // The datasheet doesn't specify what the expected value for a successful CRC test is.
-  // A successful test on the 3360 seems to return the value 0xbeef.
-  debugLogger.printf("SROM CRC test result: 0x%02x%02x\n", upper, lower);
-#endif
+  // Wait at least 200us before checking the SROM_ID, then poll until it shows up.
+  upload_state = upload_verify;
+  upload_poll_started = millis();
+  upload_due = micros() + 200;
+}
 
-  switch(product_id)
+#if ADNS_DMA_SROM
+// On the rp2040, the SROM image is fed to the SPI transmit FIFO by DMA, paced by one of the DMA pacing timers.
+// The CPU is free for the entire upload.
+bool adns::srom_dma_begin()
+{
+  spi_inst_t *spi = (spi_dev == &SPI1)?spi1:spi0;
+
+  srom_dma_channel = dma_claim_unused_channel(false);
+  if (srom_dma_channel < 0)
+  {
+    return false;
+  }
+  srom_dma_timer = dma_claim_unused_timer(false);
+  if (srom_dma_timer < 0)
   {
-    case PID_pmw3360dm:
-      // Read the SROM_ID register to verify the ID before any other register reads or writes.
-      read_reg(REG_SROM_ID);
+    dma_channel_unclaim(srom_dma_channel);
+    return false;
+  }
 
-      // Write 0x00 to Config2 register for wired mouse or 0x20 for wireless mouse design.
-      write_reg(REG_Configuration_II, 0x00);
+  // One byte per timer tick. The tick period covers the time to clock out a byte plus the 15us minimum gap.
+  const uint32_t tick_rate = 1000000 / (mcs_tLOAD + 5);
+  dma_timer_set_fraction(srom_dma_timer, 1, clock_get_hz(clk_sys) / tick_rate);
 
-      // set initial CPI resolution
-      // We do this later, using set_cpi().
-      // write_reg(REG_Configuration_I, 0x15);
-    break;
+  dma_channel_config config = dma_channel_get_default_config(srom_dma_channel);
+  channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+  channel_config_set_read_increment(&config, true);
+  channel_config_set_write_increment(&config, false);
+  channel_config_set_dreq(&config, dma_get_timer_dreq(srom_dma_timer));
 
-    case PID_pmw3389dm:
-      // Read the SROM_ID register to verify the ID before any other register reads or writes.
-      read_reg(REG_SROM_ID);
+  // The first byte also needs to wait tLOAD after the address.
+  delayMicroseconds(mcs_tLOAD);
+  dma_channel_configure(srom_dma_channel, &config, &spi_get_hw(spi)->dr, srom_data, srom_length, true);
 
-      // Write 0x00 to Config2 register for wired mouse or 0x20 for wireless mouse design.
-      write_reg(REG_Configuration_II, 0x00);
+  return true;
+}
 
-      // set initial CPI resolution
-      // We do this later, using set_cpi().
-      // write_reg(REG_Configuration_I, 0x15);
-    break;
+bool adns::srom_dma_finished()
+{
+  if (dma_channel_is_busy(srom_dma_channel))
+  {
+    return false;
+  }
+
+  spi_inst_t *spi = (spi_dev == &SPI1)?spi1:spi0;
+
+  // Wait for the last byte to leave the shift register.
+  while (spi_is_busy(spi)) {}
+
+  // Nothing read the receive FIFO during the upload. Empty it and clear the overrun.
+  while (spi_is_readable(spi))
+  {
+    (void)spi_get_hw(spi)->dr;
   }
+  spi_get_hw(spi)->icr = SPI_SSPICR_RORIC_BITS;
 
+  dma_timer_unclaim(srom_dma_timer);
+  dma_channel_unclaim(srom_dma_channel);
   return true;
 }
+#endif
 
-void adns::dispRegisters(void)
+// Registers displayed by dispRegisters()
+typedef struct
 {
-  if (debugLogger.enabled())
+  int id;
+  const char *name;
+} regInfo;
+#define REG(x) { REG_##x, #x }
+static const regInfo oreg[] = 
+{
+  REG(Product_ID), 
+  REG(Inverse_Product_ID),
+  REG(SROM_ID),
+  REG(Motion), 
+  REG(Configuration_I), 
+  REG(Lift_Detection_Thr)
+};
+#undef REG
+
+static void print_register(adns &sensor, byte reg, byte value)
+{
+  const char *name = "?";
+  for(unsigned int rctr=0; rctr<(sizeof(oreg)/sizeof(oreg[0])); rctr++)
   {
-    typedef struct
+    if (oreg[rctr].id == reg)
     {
-      int id;
-      const char *name;
-    } regInfo;
-    #define REG(x) { REG_##x, #x }
-    regInfo oreg[] = 
-    {
-      REG(Product_ID), 
-      REG(Inverse_Product_ID),
-      REG(SROM_ID),
-      REG(Motion), 
-      REG(Configuration_I), 
-      REG(Lift_Detection_Thr)
-    };
-    #undef REG
-
-    byte regres;
+      name = oreg[rctr].name;
+    }
+  }
+  debugLogger.printf("%s (0x%02x) = 0x%02x / 0b",
+    name,
+    int(reg),
+    int(value)
+  );
+  // printf doesn't have a binary conversion, so just use the builtin.
+  debugLogger.println(value, BIN);  
+}
 
+void adns::dispRegisters(void)
+{
+  if (debugLogger.enabled())
+  {
+    // The reads are queued, and the values get printed from service() as they come in.
     for(unsigned int rctr=0; rctr<(sizeof(oreg)/sizeof(oreg[0])); rctr++)
     {
-      regres = read_reg(oreg[rctr].id);
-      debugLogger.printf("%s (0x%02x) = 0x%02x / 0b",
-        oreg[rctr].name,
-        int(oreg[rctr].id),
-        int(regres)
-      );
-      // printf doesn't have a binary conversion, so just use the builtin.
-      debugLogger.println(regres, BIN);  
-      delay(1);
+      queue_read(oreg[rctr].id, print_register);
     }
   }
 }
 
-Vector adns::motion()
+CountVector adns::motion()
+{
+  begin_motion();
+  return end_motion();
+}
+
+bool adns::begin_motion()
 {
   if (chip_state != chip_state_motion)
   {
     // In capture mode, we have no motion tracking.
-    return Vector(0, 0);
+    return false;
+  }
+  if (burst_state == burst_in_flight)
+  {
+    // Already started
+    return true;
+  }
+  if (!motion_pending())
+  {
+    // The sensor hasn't signaled any motion, so there's no need to touch the bus.
+    // That also means nothing was counted at the old CPI, if it just changed.
+    x = 0;
+    y = 0;
+    cpi_blend = false;
+    return false;
+  }
+  if (bus_owner && bus_owner != this && bus_owner->uploading())
+  {
+    // Another sensor on the bus is partway through its firmware upload, which takes a while.
+    // Skip this poll rather than waiting for it.
+    return false;
   }
   read_motion_burst();
-  return Vector(x * cpi_scale_factor, y * cpi_scale_factor);
+  return true;
+}
+
+bool adns::poll_motion()
+{
+  if (burst_state == burst_in_flight)
+  {
+#if ADNS_ASYNC_BURST && defined(ARDUINO_ARCH_RP2040)
+    if (!spi_dev->finishedAsync())
+    {
+      return false;
+    }
+#elif ADNS_ASYNC_BURST
+    if (spi_dev->isBusy())
+    {
+      return false;
+    }
+#endif
+    finish_motion_burst();
+  }
+  return burst_state == burst_complete;
+}
+
+CountVector adns::end_motion()
+{
+  if (burst_state == burst_idle && !begin_motion())
+  {
+    return CountVector(0, 0);
+  }
+  finish_motion_burst();
+  burst_state = burst_idle;
+  int32_t scale = burst_scale();
+  return CountVector(scale_counts(x, scale, remainder_x), scale_counts(y, scale, remainder_y));
+}
+
+int32_t adns::burst_scale()
+{
+  if (!cpi_blend)
+  {
+    return cpi_scale_q16;
+  }
+  cpi_blend = false;
+
+  // Assume the ball moved at a steady speed between the bursts.
+  unsigned long span = burst_micros - previous_burst_micros;
+  unsigned long before = cpi_change_micros - previous_burst_micros;
+  if (span == 0 || before >= span)
+  {
+    // The change went out after this burst started, so all of it was at the old CPI.
+    return previous_scale_q16;
+  }
+  return previous_scale_q16 + (int32_t)(((int64_t)(cpi_scale_q16 - previous_scale_q16) * (span - before)) / span);
 }
 
 void adns::read_motion_burst()
 {
-  byte burst[14];
-  
-  com_begin();
+  // Any motion signaled from here on will be picked up by the next burst.
+  motion_signaled = false;
+  previous_burst_micros = burst_micros;
+  burst_micros = micros();
+
+  // The burst clock is also limited by what the self-test found.
+  com_begin((timing->sclk_burst < spi_clock)?timing->sclk_burst:spi_clock);
 
   // Read the burst register to start the transfer
   spi_dev->transfer(REG_Motion_Burst & 0x7F );
-  delayMicroseconds(mcs_tSRAD_MOTBR);
-  for (int i = 0; i < 14; i++)
+  delayMicroseconds(timing->tSRAD_MOTBR);
+
+  burst_state = burst_in_flight;
+#if ADNS_ASYNC_BURST && defined(ARDUINO_ARCH_RP2040)
+  spi_dev->transferAsync(burst_zeros, burst, sizeof(burst));
+  bus_owner = this;
+#elif ADNS_ASYNC_BURST
+  spi_dev->transfer(burst_zeros, burst, sizeof(burst), false);
+  bus_owner = this;
+#else
+  for (unsigned int i = 0; i < sizeof(burst); i++)
   {
-      burst[i] = spi_dev->transfer(0x00);
+      burst[i] = spi_dev->transfer(burst_zeros[i]);
+  }
+  finish_motion_burst();
+#endif
+}
+
+void adns::finish_motion_burst()
+{
+  if (burst_state != burst_in_flight)
+  {
+    return;
   }
 
+#if ADNS_ASYNC_BURST && defined(ARDUINO_ARCH_RP2040)
+  while (!spi_dev->finishedAsync()) {}
+#elif ADNS_ASYNC_BURST
+  spi_dev->waitForTransfer();
+#endif
+
   com_end();
-  delayMicroseconds(mcs_tBEXIT);
-  
+  delayMicroseconds(timing->tBEXIT);
+  if (bus_owner == this)
+  {
+    bus_owner = NULL;
+  }
+  burst_state = burst_complete;
+
   // Clear residual motion by writing the Motion register
   write_reg(REG_Motion, 0x00);
-  
+
+  decode_motion_burst(burst);
+
+  if (burst_callback)
+  {
+    burst_callback(*this);
+  }
+}
+
+bool adns::lifted()
+{
+  if (product_id == PID_adns9800)
+  {
+    // The 9800 doesn't have a lift bit, but it does flag laser trouble:
+    // bit 6 (FAULT) is set on a laser fault, and bit 5 (LP_VALID) is clear if the laser power settings aren't valid.
+    return (Motion & 0x40) || !(Motion & 0x20);
+  }
+  // Lift_Stat
+  return (Motion & 0x08) != 0;
+}
+
+void adns::decode_motion_burst(const byte *data)
+{
   // Extract burst values
-  Motion = burst[0];
-  Observation = burst[1];
-  x = bytes2int(burst[3], burst[2]);  
-  y = bytes2int(burst[5], burst[4]);  
-  SQUAL = burst[6];
-  Pixel_Sum = burst[7];
-  Maximum_Pixel = burst[8];
-  Minimum_Pixel = burst[9];
-  Shutter = bytes2int(burst[10], burst[11]);
-  Frame_Period = bytes2int(burst[12], burst[13]);
+  decode_burst(data);
 
   if (debugLogger.enabled())
   {
 #if 0
     debugLogger.print(F("burst motion data:"));
-    for (int i = 0; i < 14; i++)
+    for (int i = 0; i < adns_burst::size; i++)
     {
-      debugLogger.print(burst[i], HEX);
+      debugLogger.print(data[i], HEX);
       debugLogger.print(F(" "));
     }
     debugLogger.print(F(", x = "));
@@ -550,55 +1542,70 @@ void adns::read_motion_burst()
   
 }
 
-void adns::set_cpi(int cpi)
+int adns::max_cpi()
+{
+    return model?model->cpi_max:0;
+}
+
+bool adns::set_cpi(int cpi)
 {
-    // Save the current CPI and calculate the divisor to use when reporting motion.
-    current_cpi = cpi;
-    cpi_scale_factor = report_cpi;
-    cpi_scale_factor /= cpi;
+    if (model == NULL)
+    {
+      // Nothing to write, so just take the new value.
+      pending_cpi = cpi;
+      apply_pending_cpi(*this, 0, 0);
+      return true;
+    }
+
+    return write_cpi(cpi, model->cpi_step, model->cpi_max, model->cpi_registers);
+}
 
-    debugLogger.printf("set_cpi(): cpi = %d, report_cpi = %d, cpi_scale_factor = %lf",
+bool adns::write_cpi(int cpi, int cpi_step, int cpi_max, int cpi_registers)
+{
+    // Either all of the writes go in the queue or none of them do.
+    if (reg_queue_count + cpi_registers > reg_queue_size)
+    {
+      return false;
+    }
+
+    // The register writes are queued, so the new CPI (and the divisor to use when reporting motion) 
+    // only takes effect once the last of them has gone out. See apply_pending_cpi().
+    pending_cpi = cpi;
+
+    debugLogger.printf("set_cpi(): cpi = %d, report_cpi = %d",
       cpi,
-      report_cpi,
-      cpi_scale_factor);
+      report_cpi);
 
-    // Setting the sensor cpi differs by sensor model.
-    switch(product_id)
+    // The sensors take the resolution in units of cpi_step. See the notes on the model descriptions above.
+    cpi /= cpi_step;
+    cpi = CLAMP(cpi, 1, (cpi_max / cpi_step));
+    if (cpi_registers == 1)
+    {
+      queue_write(REG_Configuration_I, cpi, apply_pending_cpi);
+      debugLogger.printf(", REG_Configuration_I = 0x%02x", cpi);
+    }
+    else
     {
-      case PID_adns9800:
-        // The ADNS-9800 datasheet says that the value of REG_Configuration_I specifies the resolution in units of 50 cpi,
-        //     with a minimum of 0x01 (50 cpi) and a maximum of 0xA4 (8200cpi).
-        cpi /= 50;
-        cpi = CLAMP(cpi, 1, 0xA4);
-        write_reg(REG_Configuration_I, cpi);
-        debugLogger.printf(", REG_Configuration_I = 0x%02x", cpi);
-      break;
-      case PID_pmw3360dm:
-        // The pmw3360DM datasheet I have defines register 0x0F as "Config1", but does not specifically define allowable bit values.
-        //     It does say that the chip has "selectable resolutions up to 12000cpi with 100cpi step size", and that the default value
-        //     for the register is 0x31.
-        cpi /= 100;
-        cpi = CLAMP(cpi, 1, (12000 / 100));
-        write_reg(REG_Configuration_I, cpi);
-        debugLogger.printf(", REG_Configuration_I = 0x%02x", cpi);
-      break;
-      case PID_pmw3389dm:
-        // The pmw3389DM datasheet I have defines register 0x0F as "Resolution_L" and register 0x0E as "Resolution_H", and also does not
-        //     define allowable values. It says that the chip has "selectable resolutions up to 16000CPI with 50CPI step size", and shows
-        //     default values of 0x42 for Resolution_L and 0x0 for Resolution_H.
-        //     16000 / 50 comes out to 320 (> 255), so it makes sense that they would need an additional 8 bit register for the full range.
-        cpi /= 50;
-        cpi = CLAMP(cpi, 1, (16000 / 50));
-        write_reg(REG_Resolution_L, cpi & 0x00FF);
-        write_reg(REG_Resolution_H, cpi >> 8);
-        debugLogger.printf(", REG_Resolution_L = 0x%02x, REG_Resolution_H = 0x%02x",
-          cpi & 0x00FF,
-          cpi >> 8);
-      break;
-      default:
-      break;
+      queue_write(REG_Resolution_L, cpi & 0x00FF);
+      queue_write(REG_Resolution_H, cpi >> 8, apply_pending_cpi);
+      debugLogger.printf(", REG_Resolution_L = 0x%02x, REG_Resolution_H = 0x%02x",
+        cpi & 0x00FF,
+        cpi >> 8);
     }
     debugLogger.printf("\n");
+    return true;
+}
+
+void adns::apply_pending_cpi(adns &sensor, byte reg, byte value)
+{
+    // Save the current CPI and calculate the scale factor to use when reporting motion.
+    // Any remainder carried from the old CPI is in units of reported counts, so it's still valid.
+    // The counts the sensor has collected since the last burst aren't, so the next burst blends the two (see burst_scale()).
+    sensor.cpi_blend = (sensor.current_cpi > 0);
+    sensor.previous_scale_q16 = sensor.cpi_scale_q16;
+    sensor.cpi_change_micros = micros();
+    sensor.current_cpi = sensor.pending_cpi;
+    sensor.cpi_scale_q16 = cpi_scale_factor(sensor.report_cpi, sensor.current_cpi);
 }
 
 void adns::set_snap_angle(byte enable)
@@ -608,22 +1615,7 @@ void adns::set_snap_angle(byte enable)
 
 int adns::image_width()
 {
-  int result = 0;
-  switch(product_id)
-  {
-    case PID_adns9800:
-      result = 30;
-    break;
-    case PID_pmw3360dm:
-      result = 36;
-    break;
-    case PID_pmw3389dm:
-      result = 36;
-    break;
-    default:
-    break;
-  }
-  return result;  
+  return model?model->image_width:0;
 }
 int adns::image_height()
 {
@@ -656,9 +1648,20 @@ void adns::begin_image_capture()
       return;
   }
 
-  reset();
-  enable_laser();
-  chip_state = chip_state_image_capture;
+  capture_pending = true;
+  if ((init_state == init_done) || (init_state == init_failed) || (init_state == init_idle))
+  {
+    // Start the reset. init_step() takes it from there.
+    chip_state = chip_state_uninitialized;
+    init_state = init_reset;
+    init_due = millis();
+  }
+  // Otherwise, the sensor is still coming up, and init_step() will start over once it knows which model this is.
+}
+
+bool adns::capturing()
+{
+  return chip_state == chip_state_image_capture;
 }
 
 void adns::read_image(uint8_t *pixels)
@@ -681,7 +1684,7 @@ void adns::read_image(uint8_t *pixels)
   // I suspect it may be a mis-print. This code works on the hardware I have (both adns9800 and pmw3360)
 
   // Bump up the SPI speed a bit for this transaction, since there's a fair bit of data to move.
-  com_begin(true);
+  com_begin(timing->sclk_image);
 
   // Since we're touching all the pixels anyway, calculate the min and max values as we read them.
   uint8_t min = 255;
@@ -690,7 +1693,7 @@ void adns::read_image(uint8_t *pixels)
   // Reading a value from this register starts burst mode.
   // The value of this first read seems to be garbage, so just discard it.
   spi_dev->transfer(REG_Pixel_Burst & 0x7f);
-  delayMicroseconds(mcs_tSRAD);
+  delayMicroseconds(timing->tSRAD);
 
     for(size_t i = 0; i < datasize; i++)
     {
@@ -701,7 +1704,7 @@ void adns::read_image(uint8_t *pixels)
         delayMicroseconds(5);
     }
 
-  delayMicroseconds(mcs_tBEXIT);
+  delayMicroseconds(timing->tBEXIT);
   com_end();
 
   Minimum_Pixel = min;
@@ -715,9 +1718,12 @@ void adns::end_image_capture()
       return;
   }
   // Just reinitialize the sensor and restore the previously set CPI.
-  int previous_cpi = current_cpi;
-  init();
-  set_cpi(previous_cpi);
+  capture_pending = false;
+  if (current_cpi > 0)
+  {
+    restore_cpi = current_cpi;
+  }
+  begin_init();
 }
 
 
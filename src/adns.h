@@ -2,6 +2,8 @@
 // Removing the define for sensor types you're not using will save you around 4KB of flash for each one.
 // It's fine to leave both of them defined, the code will probe the sensor type at runtime and use 
 // the correct firmware.
+// If every sensor in the build is an adns_fixed<> (see the end of this file), the linker drops the firmware
+// for the other models on its own.
 #define ADNS_SUPPORT_ADNS9800 1
 #define ADNS_SUPPORT_PMW3360DM 1
 #define ADNS_SUPPORT_PMW3389DM 1
@@ -14,13 +16,44 @@
 #include <Adafruit_SPIDevice.h>
 #endif
 
-class adns
+// When this is 1, begin_motion() hands the bytes of the motion burst to the SPI peripheral's DMA and returns
+// without waiting for them to arrive. This uses transferAsync() on the arduino-pico core (rp2040), and the 
+// non-blocking DMA transfer() on the Adafruit SAMD core (QT Py M0). Other cores fall back to a synchronous read.
+// Define this to 0 in build_flags to turn it off.
+#if !defined(ADNS_ASYNC_BURST)
+  #if !defined(ADNS_USE_SPIDEVICE_ABSTRACTION) && (defined(ARDUINO_ARCH_RP2040) || defined(ADAFRUIT_QTPY_M0))
+    #define ADNS_ASYNC_BURST 1
+  #else
+    #define ADNS_ASYNC_BURST 0
+  #endif
+#endif
+
+// When this is 1, the SROM firmware image is streamed to the sensor by DMA, paced by a hardware timer (rp2040 only).
+// Otherwise it's streamed a slice at a time from firmware_upload_step().
+#if !defined(ADNS_DMA_SROM)
+  #if !defined(ADNS_USE_SPIDEVICE_ABSTRACTION) && defined(ARDUINO_ARCH_RP2040)
+    #define ADNS_DMA_SROM 1
+  #else
+    #define ADNS_DMA_SROM 0
+  #endif
+#endif
+
+#include "adns_burst.h"
+#include "cpi_scale.h"
+
+struct adns_timing;
+struct adns_model;
+
+class adns : public adns_burst
 {
 public:
     // Set up using the default SPI device
     adns(int8_t ncs, int report_cpi);
     // Set up using a specific SPI device
     adns(int8_t ncs, int report_cpi, SPIClass &spi);
+    // Set up using a specific SPI device, with the sensor's MOT (motion) output connected to the specified pin.
+    // The pin is watched with an interrupt, and the sensor is only read when it has signaled motion.
+    adns(int8_t ncs, int report_cpi, SPIClass &spi, int8_t motion);
 
 #if defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
     // Set up using software SPI
@@ -35,8 +68,55 @@ public:
     // Sets up the chip select for this instance and initializes the chip (upload firmware, etc).
     // Returns true if successful.
     bool init ();
-    // Polls the sensor and returns motion vector scaled to report_cpi
-    Vector motion();
+
+    // Non-blocking version of init().
+    // begin_init() starts the process, and init_step() advances it without waiting on any of the delays involved.
+    // Calling init_step() on several sensors in turn brings them up together, overlapping their waits.
+    // init_step() returns true once the sensor is either ready (initialized() returns true) or has failed.
+    void begin_init();
+    bool init_step();
+    bool initialized();
+    // Returns true if the last initialization attempt failed.
+    bool failed();
+    // Polls the sensor and returns motion vector scaled to report_cpi, in whole counts.
+    CountVector motion();
+
+    // Returns true if the sensor may have motion to report.
+    // With a motion pin, this is true only if the sensor has asserted it since the last burst read.
+    // Without one, this always returns true.
+    bool motion_pending();
+
+    // Called from the motion pin's interrupt handler.
+    void motion_interrupt();
+
+    // Split version of motion(), which lets the caller do other work while the burst is being transferred.
+    // begin_motion() starts the burst read and returns immediately. It returns false if the sensor isn't tracking motion.
+    // poll_motion() returns true once the burst has completed and the public fields below have been filled in.
+    // end_motion() waits for the burst to complete (starting one if necessary) and returns what motion() would have.
+    bool begin_motion();
+    bool poll_motion();
+    CountVector end_motion();
+
+    // If set, this is called as soon as a burst has been decoded, before poll_motion() or end_motion() return.
+    typedef void (*motion_callback)(adns &sensor);
+    void set_motion_callback(motion_callback callback) { burst_callback = callback; };
+
+    // Queued register access.
+    // These add a register write or read to a per-sensor queue, which service() works through in order.
+    // The datasheet delays between transactions (tSRAD, tSWW, tSRW, etc.) are enforced using timestamps, 
+    // so none of this spins the CPU. If the queue is full, these don't wait for room. They return false and drop the transaction.
+    // The callback for a read is called from service() once the value is available.
+    // The (optional) callback for a write is called once the write has been sent.
+    typedef void (*register_callback)(adns &sensor, byte reg, byte value);
+    bool queue_write(byte reg, byte data, register_callback callback = NULL);
+    bool queue_read(byte reg, register_callback callback);
+
+    // Advances the queued register transactions. This should be called regularly (i.e. every time through loop()).
+    // Returns true if there's nothing left in the queue.
+    bool service();
+
+    // Calls service() until the queue is empty.
+    void flush();
 
     // These give the size of the sensor image that read_image will return.
     int image_width();
@@ -45,15 +125,22 @@ public:
 
     // This puts the sensor into image capture mode. 
     // While in this mode the hardware will not track motion, and calling motion() will do nothing and return (0, 0).
+    // Like begin_init(), this only starts the process. Keep calling init_step() until capturing() returns true.
     void begin_image_capture();
+    bool capturing();
 
     // This reads pixels from the sensor when in capture mode.
     // It will store image_data_size() bytes (one byte per pixel) to the specified address.
+    // This one does block, for as long as it takes to read the whole image. It's only used for the sensor display.
     void read_image(uint8_t *pixels);
 
-    // This ends image capture mode and puts the sensor back into motion tracking mode.
+    // This ends image capture mode and puts the sensor back into motion tracking mode, at the CPI it had before.
+    // This goes through begin_init(), so init_step() needs to be called until the sensor is back up.
     void end_image_capture();
 
+    // How long the last firmware upload took (from the start of the upload until the CRC check came back), in microseconds.
+    unsigned long upload_micros;
+
     // Which type of sensor was detected. Expected values are from the following enum.
     int sensor_type() { return product_id; };
     enum
@@ -65,28 +152,23 @@ public:
         PID_pmw3389dm = 0x47,   // pmw3389 support contributed by https://github.com/JPJrunesJPJ
     };
 
-    // These are all the fields in the burst motion response.
-    // All of them are filled in each time motion() is called.
-    // Some of them may be useful.
-    byte Motion;
-    byte Observation;
-    int x;
-    int y;
-    byte SQUAL;
-    byte Pixel_Sum;
-    byte Maximum_Pixel;
-    byte Minimum_Pixel;
-    int Shutter;
-    int Frame_Period;
+    // The fields of the burst motion response are in adns_burst.
+
+    // Returns true if the last motion burst says the sensor can't see the surface properly.
+    // On the PMW33xx sensors this is the lift bit (Lift_Stat). The ADNS-9800 doesn't have one, so there it means
+    // a laser fault (FAULT set) or invalid laser power settings (LP_VALID clear).
+    bool lifted();
 
     // These are public so that code that wants to do tricky things with dynamic CPI adjustment can use them. 
     // Make sure you understand how the variables are used internally before you modify them.
    
     // This method sets the cpi value which the sensor is asked to report at. 
     // By default, the initializer will set this to the maximum cpi that the detected model of sensor is capable of.
-    // Calling this changes the hardware registers on the sensor to report at the specified cpi, 
-    // and also uses the current value of report_cpi to recalculate cpi_scale_factor.
-    void set_cpi(int cpi);
+    // Calling this queues writes to the hardware registers on the sensor to report at the specified cpi.
+    // Once they've been sent (by service()), current_cpi is updated and cpi_scale_q16 is recalculated
+    // using the current value of report_cpi.
+    // Returns false (and changes nothing) if there isn't room in the queue for the writes. Try again later.
+    bool set_cpi(int cpi);
     
     // This is the cpi that the caller wants to be reported back when calling motion().
     // The values read from the sensor will be scaled to this cpi.
@@ -94,9 +176,31 @@ public:
 
     // This is the cpi value that the sensor is currently running at.
     int current_cpi;
+
+    // Returns true if set_cpi() has been called and its register writes haven't gone out yet.
+    bool cpi_changing() { return pending_cpi != current_cpi; };
+
+    // The highest cpi the sensor supports, or 0 if it hasn't been identified yet.
+    int max_cpi();
     
-    // This is the scaling factor used to translate from current_cpi to report_cpi when motion() is called.
-    double cpi_scale_factor;
+    // This is the scaling factor used to translate from current_cpi to report_cpi when motion() is called,
+    // as a 16.16 fixed point value (i.e. 65536 means 1.0).
+    // This used to be a double, but the SAMD21 has no FPU, and doing it in software on every poll adds up.
+    int32_t cpi_scale_q16;
+
+protected:
+    // Looks up the description of a sensor model by product ID. Returns NULL if the model isn't supported.
+    typedef const adns_model *(*model_lookup)(int product_id);
+
+    // The public constructors use a lookup which knows every model this build supports.
+    // adns_fixed<> passes one which only knows about its own model.
+    adns(int8_t ncs, int report_cpi, SPIClass &spi, int8_t motion, model_lookup lookup);
+#if defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
+    adns(int8_t ncs, int report_cpi, int8_t sck, int8_t miso, int8_t mosi, model_lookup lookup);
+#endif
+
+    // Queues the register writes for set_cpi(), given the CPI layout of the sensor model.
+    bool write_cpi(int cpi, int cpi_step, int cpi_max, int cpi_registers);
 
 private:
     // SPI device abstraction
@@ -104,22 +208,54 @@ private:
     Adafruit_SPIDevice *spi_dev;
 #else
     int ncs;
-    SPISettings settings;
     SPIClass *spi_dev;
 #endif
 
-    void common_construct();
-    void reset();
+    void common_construct(model_lookup lookup);
+    // These queue the register transactions, and init_step() waits for them to go out.
+    void begin_reset();
+    void finish_reset();
     
+    // Uploading the firmware is done in steps, so the waits can be overlapped with other work.
+    // The register accesses around the upload go through the queue. Only streaming the image itself 
+    // holds the CPU, for at most srom_slice_micros per step (or not at all, with ADNS_DMA_SROM).
+    // upload_firmware() runs all of the steps and returns when it's done.
     bool upload_firmware();
+    bool begin_firmware_upload();
+    bool firmware_upload_step();
+    void end_firmware_stream();
+#if ADNS_DMA_SROM
+    bool srom_dma_begin();
+    bool srom_dma_finished();
+#endif
     void enable_laser();
-    void com_begin(bool fast = false);
+    // clock = 0 uses the register clock for this instance.
+    void com_begin(uint32_t clock = 0);
+
+    // Chooses the timing profile for the detected sensor model, and runs the SPI clock self-test.
+    // Each call to self_test_step() checks one clock with queued reads. It returns true once the fastest reliable clock is known.
+    void select_timing();
+    bool self_test_step();
+    int8_t self_test_index;
+    bool self_test_passed;
+    uint32_t self_test_good_clock;
+    static void check_self_test(adns &sensor, byte reg, byte value);
     void com_end();
 
     byte read_reg(byte reg_addr);
     void write_reg(byte reg_addr, byte data);
 
+    void release_bus();
+    bool uploading();
+    unsigned long ready_wait();
+
     void read_motion_burst();
+    void finish_motion_burst();
+    void decode_motion_burst(const byte *data);
+
+    // The fraction of a count left over from scaling the last burst (see scale_counts() in cpi_scale.h).
+    int32_t remainder_x;
+    int32_t remainder_y;
     
     void set_snap_angle(byte enable);    
 
@@ -129,4 +265,156 @@ private:
 
     int chip_state;
 
+    // Description of the detected sensor model (NULL until it's been probed)
+    model_lookup find_model;
+    const adns_model *model;
+
+    // SPI timing for this sensor model
+    const adns_timing *timing;
+    // The clock used for register access, as determined by the self-test.
+    uint32_t spi_clock;
+
+    // Motion pin, or -1 if there isn't one
+    int8_t motion_pin;
+    volatile bool motion_signaled;
+    void attach_motion_pin();
+
+    // Initialization state
+    byte init_state;
+    unsigned long init_due;
+    // Set by begin_image_capture(). The init steps put the sensor into capture mode instead of tracking motion.
+    bool capture_pending;
+    // CPI to restore when end_image_capture() brings the sensor back up, or 0 for the maximum.
+    int restore_cpi;
+
+    // Motion burst state
+    byte burst[adns_burst::size];
+    byte burst_state;
+    motion_callback burst_callback;
+
+    // micros() timestamp before which the next SPI transaction must not start.
+    // This lets read_reg() and write_reg() return without spinning through tSRW/tSWW.
+    unsigned long ready_at;
+
+    // Register transaction queue
+    struct reg_op
+    {
+      byte reg;
+      byte data;
+      bool write;
+      register_callback callback;
+    };
+    enum { reg_queue_size = 16 };
+    reg_op reg_queue[reg_queue_size];
+    byte reg_queue_head;
+    byte reg_queue_count;
+    // Set while a queued read has sent its address and is waiting out tSRAD with the chip select asserted.
+    bool reg_read_pending;
+    unsigned long reg_read_due;
+    void complete_queued_read();
+    // The init and upload steps read registers through the queue, with this callback leaving the value in queued_value.
+    byte queued_value;
+    static void store_value(adns &sensor, byte reg, byte value);
+
+    // Firmware upload state
+    byte upload_state;
+    const uint8_t *srom_data;
+    unsigned short srom_length;
+    unsigned short srom_offset;
+    unsigned long srom_next_byte;
+    unsigned long upload_started;
+    unsigned long upload_poll_started;
+    unsigned long upload_due;
+    byte upload_crc_upper;
+#if ADNS_DMA_SROM
+    int srom_dma_channel;
+    int srom_dma_timer;
+#endif
+
+    // CPI that will become current_cpi once set_cpi()'s register writes have gone out.
+    int pending_cpi;
+    static void apply_pending_cpi(adns &sensor, byte reg, byte value);
+
+    // When the CPI changes between two bursts, the counts in the second one were partly taken at the old CPI.
+    // That burst gets a scale factor between the old and new ones, weighted by how much of the time between
+    // the bursts went by before the change, so the change doesn't show up as a jump in the reported motion.
+    bool cpi_blend;
+    int32_t previous_scale_q16;
+    unsigned long cpi_change_micros;
+    // micros() when the last two bursts started.
+    unsigned long burst_micros;
+    unsigned long previous_burst_micros;
+    int32_t burst_scale();
+
+};
+
+// Compile-time descriptions of the supported sensor models, for use with adns_fixed<>.
+// The generic adns class looks up the same values at runtime, once it has probed the sensor.
+// (model() is only defined if the corresponding ADNS_SUPPORT_ define is.)
+struct adns_adns9800
+{
+  enum
+  {
+    product_id = adns::PID_adns9800,
+    cpi_step = 50,
+    cpi_max = 8200,
+    cpi_registers = 1,
+    image_width = 30,
+  };
+  static const adns_model &model();
+};
+
+struct adns_pmw3360dm
+{
+  enum
+  {
+    product_id = adns::PID_pmw3360dm,
+    cpi_step = 100,
+    cpi_max = 12000,
+    cpi_registers = 1,
+    image_width = 36,
+  };
+  static const adns_model &model();
+};
+
+struct adns_pmw3389dm
+{
+  enum
+  {
+    product_id = adns::PID_pmw3389dm,
+    cpi_step = 50,
+    cpi_max = 16000,
+    cpi_registers = 2,
+    image_width = 36,
+  };
+  static const adns_model &model();
+};
+
+// A driver for one specific model of sensor (i.e. adns_fixed<adns_pmw3360dm>).
+// The CPI register layout and image size are compile-time constants, and only this model's firmware 
+// is referenced. Initialization still reads the product ID, and fails if it's a different model.
+// This can be used anywhere an adns can. These methods hide the adns ones rather than overriding them,
+// so calls made through an adns reference get the runtime versions, which give the same results but
+// don't get the constants. Code that wants them should take the sensor type as a template parameter.
+template <class Model>
+class adns_fixed : public adns
+{
+public:
+  adns_fixed(int8_t ncs, int report_cpi) : adns(ncs, report_cpi, SPI, -1, find) {};
+  adns_fixed(int8_t ncs, int report_cpi, SPIClass &spi) : adns(ncs, report_cpi, spi, -1, find) {};
+  adns_fixed(int8_t ncs, int report_cpi, SPIClass &spi, int8_t motion) : adns(ncs, report_cpi, spi, motion, find) {};
+#if defined(ADNS_USE_SPIDEVICE_ABSTRACTION)
+  adns_fixed(int8_t ncs, int report_cpi, int8_t sck, int8_t miso, int8_t mosi) : adns(ncs, report_cpi, sck, miso, mosi, find) {};
+#endif
+
+  bool set_cpi(int cpi) { return write_cpi(cpi, Model::cpi_step, Model::cpi_max, Model::cpi_registers); };
+  int image_width() { return Model::image_width; };
+  int image_height() { return Model::image_width; };
+  size_t image_data_size() { return Model::image_width * Model::image_width; };
+
+private:
+  static const adns_model *find(int product_id)
+  {
+    return (product_id == Model::product_id)?&Model::model():NULL;
+  }
 };
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+// The fields of the motion burst response, and the code that pulls them out of the bytes read from the sensor.
+// adns inherits from this, so the fields are still used as i.e. sensor.SQUAL.
+// This doesn't depend on anything Arduino-specific, so the decoding can be tested on the host (see test/test_burst).
+struct adns_burst
+{
+    // Number of bytes read from the burst register.
+    enum { size = 14 };
+
+    // These are all the fields in the burst motion response.
+    // All of them are filled in each time motion() is called.
+    // Some of them may be useful.
+    uint8_t Motion;
+    uint8_t Observation;
+    int x;
+    int y;
+    uint8_t SQUAL;
+    uint8_t Pixel_Sum;
+    uint8_t Maximum_Pixel;
+    uint8_t Minimum_Pixel;
+    int Shutter;
+    int Frame_Period;
+
+    // Fills in the fields from the size bytes read from the burst register.
+    void decode_burst(const uint8_t *data)
+    {
+        Motion = data[0];
+        Observation = data[1];
+        // The deltas are little-endian and signed. Shutter and Frame_Period are big-endian.
+        x = signed_word(data[3], data[2]);
+        y = signed_word(data[5], data[4]);
+        SQUAL = data[6];
+        Pixel_Sum = data[7];
+        Maximum_Pixel = data[8];
+        Minimum_Pixel = data[9];
+        Shutter = signed_word(data[10], data[11]);
+        Frame_Period = signed_word(data[12], data[13]);
+    }
+
+    static int signed_word(uint8_t high, uint8_t low)
+    {
+        return (int(int8_t(high)) * 256) + low;
+    }
+};
@@ -0,0 +1,210 @@
+#include <Arduino.h>
+
+#if defined(ARDUINO_ARCH_RP2040)
+  #include <hardware/structs/sio.h>
+#endif
+
+#include "buttons.h"
+
+button_reader *button_reader::instance = NULL;
+
+button_reader::button_reader(const int *pins, const char *names, int count, unsigned long press_micros, unsigned long release_micros)
+{
+  this->pins = pins;
+  this->names = names;
+  this->count = (count < max_buttons)?count:max_buttons;
+  this->press_micros = press_micros;
+  this->release_micros = release_micros;
+
+  for (int i = 0; i < max_buttons; i++)
+  {
+    pin_masks[i] = 0;
+    pin_ports[i] = 0;
+  }
+
+  have_held = false;
+  raw = 0;
+  stable = 0;
+  state = 0;
+  change_micros = 0;
+  for (int i = 0; i < max_buttons; i++)
+  {
+    raw_micros[i] = 0;
+    stable_micros[i] = 0;
+  }
+}
+
+void button_reader::begin()
+{
+  instance = this;
+
+  for (int i = 0; i < count; i++)
+  {
+    pinMode(pins[i], INPUT_PULLUP);
+#if defined(ARDUINO_ARCH_RP2040)
+    pin_ports[i] = 0;
+    pin_masks[i] = (1UL << pins[i]);
+#elif defined(ARDUINO_ARCH_SAMD)
+    pin_ports[i] = g_APinDescription[pins[i]].ulPort;
+    pin_masks[i] = (1UL << g_APinDescription[pins[i]].ulPin);
+#else
+    pin_ports[i] = 0;
+    pin_masks[i] = 0;
+#endif
+  }
+
+  // Start from whatever the buttons are doing now.
+  unsigned long now = micros();
+  raw = read_pins();
+  stable = raw;
+  state = 0;
+  for (int i = 0; i < count; i++)
+  {
+    raw_micros[i] = now;
+    stable_micros[i] = now;
+    if (stable & (1UL << i))
+    {
+      state |= names[i];
+    }
+  }
+  change_micros = now;
+
+  for (int i = 0; i < count; i++)
+  {
+    int interrupt = digitalPinToInterrupt(pins[i]);
+    if (interrupt != NOT_AN_INTERRUPT)
+    {
+      attachInterrupt(interrupt, edge_interrupt, CHANGE);
+    }
+  }
+}
+
+uint32_t button_reader::read_pins()
+{
+  uint32_t pressed = 0;
+#if defined(ARDUINO_ARCH_RP2040) || defined(ARDUINO_ARCH_SAMD)
+  // Read the input registers once, so all the buttons are sampled at the same instant
+  // and each extra button only costs a bit test.
+  uint32_t in[2];
+#if defined(ARDUINO_ARCH_RP2040)
+  in[0] = sio_hw->gpio_in;
+  in[1] = 0;
+#else
+  in[0] = PORT->Group[0].IN.reg;
+  in[1] = PORT->Group[1].IN.reg;
+#endif
+  for (int i = 0; i < count; i++)
+  {
+    if (!(in[pin_ports[i]] & pin_masks[i]))
+    {
+      pressed |= (1UL << i);
+    }
+  }
+#else
+  for (int i = 0; i < count; i++)
+  {
+    if (digitalRead(pins[i]) == LOW)
+    {
+      pressed |= (1UL << i);
+    }
+  }
+#endif
+  return pressed;
+}
+
+void button_reader::edge_interrupt()
+{
+  edge e;
+  e.time = micros();
+  e.pressed = instance->read_pins();
+  // If the queue is full, this edge is dropped, and update() finds the new state on the pins.
+  instance->edges.push(e);
+}
+
+bool button_reader::settle(unsigned long time)
+{
+  bool changed = false;
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t bit = (1UL << i);
+    if ((stable & bit) && !(raw & bit)
+      && (time - raw_micros[i] >= release_micros)
+      && (time - stable_micros[i] >= press_micros))
+    {
+      stable &= ~bit;
+      stable_micros[i] = time;
+      change_micros = raw_micros[i];
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+bool button_reader::apply(uint32_t pressed, unsigned long time)
+{
+  uint32_t changed_pins = pressed ^ raw;
+  uint32_t new_presses = pressed & ~stable;
+  raw = pressed;
+
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t bit = (1UL << i);
+    if (changed_pins & bit)
+    {
+      raw_micros[i] = time;
+    }
+    if (new_presses & bit)
+    {
+      stable_micros[i] = time;
+    }
+  }
+
+  if (new_presses)
+  {
+    stable |= new_presses;
+    change_micros = time;
+    return true;
+  }
+  return false;
+}
+
+bool button_reader::update()
+{
+  bool changed = false;
+  while (!changed && (have_held || edges.pop(held)))
+  {
+    // Releases that were due before this edge happened first.
+    // If there are any, the edge waits for the next call, in case it's a press of the same button.
+    have_held = true;
+    changed = settle(held.time);
+    if (!changed)
+    {
+      changed = apply(held.pressed, held.time);
+      have_held = false;
+    }
+  }
+
+  if (!changed)
+  {
+    unsigned long now = micros();
+    changed = settle(now);
+    if (!changed)
+    {
+      changed = apply(read_pins(), now);
+    }
+  }
+
+  if (changed)
+  {
+    state = 0;
+    for (int i = 0; i < count; i++)
+    {
+      if (stable & (1UL << i))
+      {
+        state |= names[i];
+      }
+    }
+  }
+
+  return changed;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "ring_buffer.h"
+
+// Reads the buttons with pin change interrupts, and debounces them.
+//
+// The interrupt handler timestamps each edge and queues the state of all the buttons, and update() works through the queue.
+// A press is reported as soon as the switch closes, and then held for at least press_micros, so the bounces that follow are ignored.
+// A release is only reported once the switch has stayed open for release_micros, so chatter from a worn switch
+// doesn't turn into extra clicks.
+// update() also reads the pins directly when the queue is empty, so a pin without an interrupt (or an edge that didn't fit
+// in the queue) is still picked up, just not as quickly.
+class button_reader
+{
+public:
+    // pins are active low (begin() turns on the pull-ups), and names has the HID button bit for each pin.
+    // There can only be one button_reader, with at most max_buttons buttons.
+    button_reader(const int *pins, const char *names, int count, unsigned long press_micros, unsigned long release_micros);
+
+    enum { max_buttons = 8 };
+
+    void begin();
+
+    // Applies the edges seen since the last call. Returns true if the debounced state changed.
+    // This stops after the first change, so that a press and release that both happened since the last call
+    // come out as two changes (and two reports) instead of cancelling out.
+    bool update();
+
+    // Debounced state, as HID button bits.
+    char state;
+
+    // micros() timestamp of the edge behind the most recent change in state.
+    unsigned long change_micros;
+
+private:
+    struct edge
+    {
+        unsigned long time;
+        uint32_t pressed;
+    };
+
+    // Returns the raw state of all the buttons (bit n set if button n is down).
+    // This reads the GPIO input register(s) once, and picks out each button's bit from that.
+    uint32_t read_pins();
+
+    // Reports releases that have been quiet for long enough by the given time.
+    bool settle(unsigned long time);
+    // Takes a new raw state, and reports any presses in it.
+    bool apply(uint32_t pressed, unsigned long time);
+
+    static void edge_interrupt();
+    static button_reader *instance;
+
+    const int *pins;
+    const char *names;
+    int count;
+    unsigned long press_micros;
+    unsigned long release_micros;
+
+    // Where each button's pin shows up in the GPIO input registers.
+    uint32_t pin_masks[max_buttons];
+    uint8_t pin_ports[max_buttons];
+
+    ring_buffer<edge, 32> edges;
+    // An edge taken from the queue that hasn't been applied yet, because a release came out ahead of it.
+    edge held;
+    bool have_held;
+
+    // Raw and debounced state (bit n for button n), and when each button's raw and debounced state last changed.
+    uint32_t raw;
+    uint32_t stable;
+    unsigned long raw_micros[max_buttons];
+    unsigned long stable_micros[max_buttons];
+};
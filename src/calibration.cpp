@@ -0,0 +1,201 @@
+#include <math.h>
+
+#include "calibration.h"
+
+// The pull toward the current transform, as a fraction of the total motion.
+static const double regularization = 0.001;
+
+// For a step to count, the current transform has to put at least this many times as much of its motion
+// on the step's own axis as on either of the others.
+static const double dominance = 2.0;
+
+transform_calibration::transform_calibration()
+{
+  cancel();
+}
+
+int transform_calibration::index(int row, int col)
+{
+  if (row > col)
+  {
+    int temp = row;
+    row = col;
+    col = temp;
+  }
+  // Rows of the upper triangle are 4, 3, 2, and 1 long.
+  static const int row_start[4] = { 0, 4, 7, 9 };
+  return row_start[row] + (col - row);
+}
+
+void transform_calibration::start()
+{
+  for (int p = 0; p < phase_count; p++)
+  {
+    samples[p] = 0;
+    for (int i = 0; i < 10; i++)
+    {
+      sums[p][i] = 0;
+    }
+  }
+  phase = roll_x;
+}
+
+void transform_calibration::next()
+{
+  if (phase != idle)
+  {
+    phase = phase_t(phase + 1);
+  }
+}
+
+void transform_calibration::cancel()
+{
+  for (int p = 0; p < phase_count; p++)
+  {
+    samples[p] = 0;
+  }
+  phase = idle;
+}
+
+void transform_calibration::add(int32_t s1x, int32_t s1y, int32_t s2x, int32_t s2y)
+{
+  phase_t p = phase;
+  if (p == idle || (s1x == 0 && s1y == 0 && s2x == 0 && s2y == 0))
+  {
+    return;
+  }
+
+  int32_t v[4] = { s1x, s1y, s2x, s2y };
+  int64_t *sum = sums[p];
+  for (int row = 0; row < 4; row++)
+  {
+    for (int col = row; col < 4; col++)
+    {
+      *sum++ += int64_t(v[row]) * v[col];
+    }
+  }
+  samples[p]++;
+}
+
+bool transform_calibration::solve(const float current[3][4], float result[3][4])
+{
+  // Unpack the sums.
+  double a[phase_count][4][4];
+  double total[4][4];
+  for (int row = 0; row < 4; row++)
+  {
+    for (int col = 0; col < 4; col++)
+    {
+      total[row][col] = 0;
+      for (int p = 0; p < phase_count; p++)
+      {
+        a[p][row][col] = double(sums[p][index(row, col)]) / 65536.0;
+        total[row][col] += a[p][row][col];
+      }
+    }
+  }
+
+  // Check each step.
+  for (int p = 0; p < phase_count; p++)
+  {
+    if (samples[p] < minimum_samples)
+    {
+      return false;
+    }
+
+    // How much of this step's motion the current transform puts on each axis.
+    double energy[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+      energy[axis] = 0;
+      for (int row = 0; row < 4; row++)
+      {
+        for (int col = 0; col < 4; col++)
+        {
+          energy[axis] += current[axis][row] * a[p][row][col] * current[axis][col];
+        }
+      }
+    }
+    for (int axis = 0; axis < 3; axis++)
+    {
+      if (axis != p && energy[p] < energy[axis] * dominance)
+      {
+        return false;
+      }
+    }
+  }
+
+  // Each row of the transform (t) solves (total + lambda * I) * t = (a[axis] + lambda * I) * current[axis].
+  // The matrix is the same for all three rows, so they're solved together.
+  double lambda = (total[0][0] + total[1][1] + total[2][2] + total[3][3]) * regularization;
+  double m[4][4];
+  double rhs[4][3];
+  for (int row = 0; row < 4; row++)
+  {
+    for (int col = 0; col < 4; col++)
+    {
+      m[row][col] = total[row][col] + ((row == col)?lambda:0);
+    }
+    for (int axis = 0; axis < 3; axis++)
+    {
+      rhs[row][axis] = lambda * current[axis][row];
+      for (int col = 0; col < 4; col++)
+      {
+        rhs[row][axis] += a[axis][row][col] * current[axis][col];
+      }
+    }
+  }
+
+  // Gaussian elimination. The matrix is symmetric and positive definite, so this doesn't need to pivot.
+  for (int pivot = 0; pivot < 4; pivot++)
+  {
+    if (m[pivot][pivot] <= 0)
+    {
+      return false;
+    }
+    for (int row = pivot + 1; row < 4; row++)
+    {
+      double factor = m[row][pivot] / m[pivot][pivot];
+      for (int col = pivot; col < 4; col++)
+      {
+        m[row][col] -= factor * m[pivot][col];
+      }
+      for (int axis = 0; axis < 3; axis++)
+      {
+        rhs[row][axis] -= factor * rhs[pivot][axis];
+      }
+    }
+  }
+  double t[4][3];
+  for (int row = 3; row >= 0; row--)
+  {
+    for (int axis = 0; axis < 3; axis++)
+    {
+      double value = rhs[row][axis];
+      for (int col = row + 1; col < 4; col++)
+      {
+        value -= m[row][col] * t[col][axis];
+      }
+      t[row][axis] = value / m[row][row];
+    }
+  }
+
+  for (int axis = 0; axis < 3; axis++)
+  {
+    for (int col = 0; col < 4; col++)
+    {
+      if (!isfinite(t[col][axis]))
+      {
+        return false;
+      }
+    }
+  }
+  for (int axis = 0; axis < 3; axis++)
+  {
+    for (int col = 0; col < 4; col++)
+    {
+      result[axis][col] = float(t[col][axis]);
+    }
+  }
+  return true;
+}
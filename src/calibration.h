@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+
+// Fits the sensor transform to how the sensors actually sit in a particular trackball.
+//
+// The user rolls the ball along each output axis in turn (X, then Y), and then twists it (Z),
+// while each raw sensor sample ([s1.x, s1.y, s2.x, s2.y]) goes into a running sum of its outer product for that step.
+// That's all that's kept (3 symmetric 4x4 sums), so it takes the same small amount of memory no matter how long it runs.
+//
+// At the end, solve() finds the transform that best maps each step's samples onto that step's axis alone.
+// The speed along the axis comes from the transform already in use, so the overall gain for each axis stays the same,
+// and what changes is the crosstalk between axes (i.e. rolling straight left moving the pointer up a bit).
+// Rolls and twists only span 3 of the 4 dimensions of the readings, so the fit is pulled gently toward the current
+// transform to pin down the leftover one.
+//
+// This doesn't depend on anything Arduino-specific, so it can be built on the host.
+class transform_calibration
+{
+public:
+    enum phase_t
+    {
+        roll_x,
+        roll_y,
+        twist,
+        phase_count,
+        idle = phase_count
+    };
+
+    transform_calibration();
+
+    // Clears the sums and starts at the first step.
+    void start();
+    // Moves on to the next step. After the last one, the phase is idle and it's time to call solve().
+    void next();
+    // Stops without solving.
+    void cancel();
+
+    // Takes one sample of raw sensor readings, in counts as 24.8 fixed point.
+    // Ignored when idle.
+    void add(int32_t s1x, int32_t s1y, int32_t s2x, int32_t s2y);
+
+    // Works out the new transform from everything collected, starting from the one currently in use.
+    // Returns false (and leaves result alone) if there wasn't enough motion in one of the steps,
+    // or the motion in a step didn't look like the axis it was supposed to be.
+    bool solve(const float current[3][4], float result[3][4]);
+
+    volatile phase_t phase;
+
+    // Number of samples with motion in each step.
+    uint32_t samples[phase_count];
+
+    // A step needs at least this many samples to be used.
+    static const uint32_t minimum_samples = 100;
+
+private:
+    // Index into a packed symmetric 4x4 matrix.
+    static int index(int row, int col);
+
+    // Upper triangle of the sum of v * transpose(v) for each step, in counts^2 as 16.16 fixed point.
+    int64_t sums[phase_count][10];
+};
@@ -0,0 +1,78 @@
+#include "classifier.h"
+
+static int32_t abs32(int32_t x)
+{
+  return (x < 0)?-x:x;
+}
+
+// Returns value * ratio, where ratio is 16.16 fixed point.
+static int64_t scale(int32_t value, int32_t ratio)
+{
+  return (int64_t(value) * ratio) >> 16;
+}
+
+motion_classifier::motion_classifier()
+{
+  // These match the old per-sample test (z more than twice x and y) on the way in.
+  settings.enter_ratio = 2 << 16;
+  settings.exit_ratio = 1 << 16;
+  settings.enter_minimum = 2 << 16;
+  settings.window_micros = 30000;
+  settings.lock_micros = 60000;
+
+  mode = pointer;
+  energy_x = 0;
+  energy_y = 0;
+  energy_z = 0;
+  last_time = 0;
+  mode_time = 0;
+}
+
+void motion_classifier::decay(int32_t &total, uint32_t elapsed)
+{
+  if (elapsed >= settings.window_micros)
+  {
+    total = 0;
+  }
+  else
+  {
+    total -= int32_t((int64_t(total) * elapsed) / settings.window_micros);
+  }
+}
+
+motion_classifier::mode_t motion_classifier::classify(int32_t x, int32_t y, int32_t z, uint32_t time)
+{
+  uint32_t elapsed = time - last_time;
+  last_time = time;
+  decay(energy_x, elapsed);
+  decay(energy_y, elapsed);
+  decay(energy_z, elapsed);
+  energy_x += abs32(x);
+  energy_y += abs32(y);
+  energy_z += abs32(z);
+
+  if (time - mode_time < settings.lock_micros)
+  {
+    return mode;
+  }
+
+  int32_t energy_xy = (energy_x > energy_y)?energy_x:energy_y;
+  if (mode == pointer)
+  {
+    if (energy_z >= settings.enter_minimum && energy_z > scale(energy_xy, settings.enter_ratio))
+    {
+      mode = scroll;
+      mode_time = time;
+    }
+  }
+  else
+  {
+    if (energy_z < scale(energy_xy, settings.exit_ratio))
+    {
+      mode = pointer;
+      mode_time = time;
+    }
+  }
+
+  return mode;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+// Decides whether the ball is being twisted (scrolling) or rolled (pointer motion).
+//
+// Each sample's x/y/z motion goes into a short, decaying running total per axis, so a single noisy sample can't
+// flip the decision. The mode only changes when z clearly dominates (or clearly doesn't), with a wider margin to get
+// into scrolling than to stay in it, and after a change the mode is locked in for a little while.
+//
+// This doesn't depend on anything Arduino-specific, so it can be built on the host and fed recorded motion traces
+// (see LOG_MOTION_TRACE in trackball.cpp).
+class motion_classifier
+{
+public:
+    enum mode_t
+    {
+        pointer,
+        scroll
+    };
+
+    struct settings_t
+    {
+        // Start scrolling when the z total is more than enter_ratio times the x and y totals,
+        // and stop when it falls below exit_ratio times either of them. 16.16 fixed point.
+        int32_t enter_ratio;
+        int32_t exit_ratio;
+        // The z total also has to be at least this much (in counts, 16.16 fixed point) to start scrolling.
+        int32_t enter_minimum;
+        // Time constant of the running totals.
+        uint32_t window_micros;
+        // Minimum time between mode changes.
+        uint32_t lock_micros;
+    };
+
+    motion_classifier();
+
+    // The settings can be changed at any time.
+    settings_t settings;
+
+    // Takes one sample of transformed motion (16.16 fixed point counts) taken at the given micros() time,
+    // and returns the mode it belongs to.
+    mode_t classify(int32_t x, int32_t y, int32_t z, uint32_t time);
+
+    mode_t mode;
+
+private:
+    void decay(int32_t &total, uint32_t elapsed);
+
+    int32_t energy_x;
+    int32_t energy_y;
+    int32_t energy_z;
+    uint32_t last_time;
+    uint32_t mode_time;
+};
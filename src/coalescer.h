@@ -0,0 +1,97 @@
+#pragma once
+
+// Holds everything that's waiting to go to the host, and merges new changes into it while the HID endpoint is busy,
+// so nothing is lost when the host is slow to take a report.
+//
+// Pointer motion, wheel, and pan are summed, and each report takes as much of them as will fit.
+// T is the element type of the motion math, so fractions of a count carry over too.
+// Buttons are state, but each change in state has to reach the host. Only one change is held here at a time,
+// and the caller has to wait for buttons_changed to clear before taking the next one, so a quick press and release
+// can't be merged into nothing.
+template <class T>
+class report_coalescer
+{
+public:
+	report_coalescer(int delta_min, int delta_max)
+	: x(0), y(0), wheel(0), pan(0), buttons(0), buttons_changed(false),
+	  sent(0), merged(0), dropped(0),
+	  delta_min(delta_min), delta_max(delta_max)
+	{}
+
+	void add_motion(T dx, T dy)
+	{
+		x += dx;
+		y += dy;
+	}
+
+	void add_wheel(int ticks) { wheel += ticks; }
+	void add_pan(int ticks) { pan += ticks; }
+
+	void set_buttons(char new_buttons)
+	{
+		buttons = new_buttons;
+		buttons_changed = true;
+	}
+
+	// The contents of the next report.
+	int report_x() const { return clamp(int(x), delta_min, delta_max); }
+	int report_y() const { return clamp(int(y), delta_min, delta_max); }
+	int report_wheel() const { return clamp(wheel, SCHAR_MIN, SCHAR_MAX); }
+	int report_pan() const { return clamp(pan, SCHAR_MIN, SCHAR_MAX); }
+
+	// Returns true if there's anything to send.
+	bool pending() const
+	{
+		return buttons_changed || (report_x() != 0) || (report_y() != 0) || (wheel != 0) || (pan != 0);
+	}
+
+	// Call this when a report with the given contents has been queued.
+	void report_sent(int report_x, int report_y, int report_wheel, int report_pan)
+	{
+		x -= T(report_x);
+		y -= T(report_y);
+		wheel -= report_wheel;
+		pan -= report_pan;
+		buttons_changed = false;
+		sent++;
+	}
+
+	// Call this when there was something to send, but the endpoint was busy. Everything stays here for the next report.
+	void report_merged() { merged++; }
+
+	// Throws away any pending motion, but not the buttons.
+	// This is for when the bus is suspended, where the motion would otherwise all arrive in a rush on resume.
+	void drop_motion()
+	{
+		if ((report_x() != 0) || (report_y() != 0) || (wheel != 0) || (pan != 0))
+		{
+			dropped++;
+		}
+		x = 0;
+		y = 0;
+		wheel = 0;
+		pan = 0;
+	}
+
+	T x;
+	T y;
+	int wheel;
+	int pan;
+	char buttons;
+	bool buttons_changed;
+
+	// Number of reports queued, reports that were held back and merged with later changes because the endpoint
+	// was busy, and times pending motion was thrown away.
+	unsigned long sent;
+	unsigned long merged;
+	unsigned long dropped;
+
+private:
+	int delta_min;
+	int delta_max;
+
+	static int clamp(int value, int min_value, int max_value)
+	{
+		return (value > max_value)?max_value:((value < min_value)?min_value:value);
+	}
+};
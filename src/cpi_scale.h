@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+// Scaling motion from the sensor's CPI to the reported CPI, as 16.16 fixed point.
+// adns uses these on every burst. They don't depend on anything Arduino-specific, so they can be tested 
+// (and timed against the old double path) on the host. See test/test_cpi_scale.
+
+// Returns the factor that takes counts at current_cpi to counts at report_cpi, or 0 if current_cpi isn't known.
+// This is rounded to the nearest 1/65536th, so over a long movement it drifts by at most half a count per 65536 counts.
+inline int32_t cpi_scale_factor(int report_cpi, int current_cpi)
+{
+    if (current_cpi <= 0)
+    {
+        return 0;
+    }
+    return (int32_t)((((int64_t)report_cpi << 16) + (current_cpi / 2)) / current_cpi);
+}
+
+// Scales a count from the sensor by scale_q16, returning whole counts at report_cpi.
+// The fraction left over is kept in remainder (in 1/65536ths of a count, signed) and added into the next call,
+// so slow motion isn't lost to rounding.
+inline int scale_counts(int counts, int32_t scale_q16, int32_t &remainder)
+{
+    // Sensor counts are 16 bits and the scale factor can be more than 1.0, so the product needs 64 bits.
+    // That's still a lot cheaper than a software double multiply.
+    int64_t scaled = (int64_t)counts * scale_q16 + remainder;
+    // This rounds to nearest, so the remainder stays within half a count either way.
+    // Flooring would make motion toward negative come out up to a count before the same motion toward positive.
+    int32_t result = (int32_t)((scaled + 0x8000) >> 16);
+    remainder = (int32_t)(scaled - ((int64_t)result << 16));
+    return result;
+}
@@ -0,0 +1,64 @@
+#include "dynamic_cpi.h"
+
+static uint32_t abs32(int32_t x)
+{
+  return (x < 0)?-x:x;
+}
+
+dynamic_cpi::dynamic_cpi()
+{
+  // 16 counts/ms at 800 cpi is 20 inches per second, and 6 counts/ms is 7.5.
+  settings.fast_speed = 16 << 8;
+  settings.slow_speed = 6 << 8;
+  settings.window_micros = 20000;
+  settings.hold_micros = 150000;
+
+  fast = false;
+  distance = 0;
+  last_time = 0;
+  switch_time = 0;
+}
+
+bool dynamic_cpi::update(int32_t x, int32_t y, uint32_t time)
+{
+  uint32_t elapsed = time - last_time;
+  last_time = time;
+  if (elapsed >= settings.window_micros)
+  {
+    distance = 0;
+  }
+  else
+  {
+    distance -= uint32_t((uint64_t(distance) * elapsed) / settings.window_micros);
+  }
+
+  // Same "alpha max plus beta min" approximation as acceleration_curve.
+  uint32_t big = abs32(x);
+  uint32_t small = abs32(y);
+  if (small > big)
+  {
+    uint32_t temp = big;
+    big = small;
+    small = temp;
+  }
+  uint32_t step = ((big / 16) * 15) + ((small / 32) * 15);
+  distance += (step > big)?step:big;
+
+  if (time - switch_time < settings.hold_micros)
+  {
+    return false;
+  }
+
+  // At a steady speed, the total settles at speed * window_micros.
+  // Speeds are counts/ms as 24.8, and the total is counts as 16.16, so the total is scaled by 1000 / 256 to compare.
+  uint64_t speed_window = (uint64_t(distance) * 1000) >> 8;
+  uint32_t threshold = fast?settings.slow_speed:settings.fast_speed;
+  bool new_fast = (speed_window >= uint64_t(threshold) * settings.window_micros);
+  if (new_fast == fast)
+  {
+    return false;
+  }
+  fast = new_fast;
+  switch_time = time;
+  return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+// Decides when the sensors should drop to a lower CPI.
+//
+// Slow, careful movements get the sensors' full resolution. Fast sweeps don't need it.
+// This isn't about the motion registers overflowing: even at 20 in/s, 12000 cpi and 125Hz reports,
+// one burst only holds about 1920 counts, well inside their 16 bits.
+//
+// Speed is a decaying running total of the distance moved (like motion_classifier's), so one fast sample can't
+// flip it. There's a gap between the speed that switches to fast and the one that switches back,
+// and after a switch it holds for a while, so it can't chatter back and forth around one speed.
+//
+// This only decides. The caller does the switching with adns::set_cpi(), whose register writes are queued,
+// and adns takes care of keeping the reported motion smooth across the change.
+//
+// This doesn't depend on anything Arduino-specific, so it can be built on the host.
+class dynamic_cpi
+{
+public:
+    struct settings_t
+    {
+        // Switch to fast above fast_speed, and back below slow_speed, in counts/ms (at the reported CPI) as 24.8 fixed point.
+        uint32_t fast_speed;
+        uint32_t slow_speed;
+        // Time constant of the running total.
+        uint32_t window_micros;
+        // Minimum time between switches.
+        uint32_t hold_micros;
+    };
+
+    dynamic_cpi();
+
+    // The settings can be changed at any time.
+    settings_t settings;
+
+    // Takes one sample of motion (in reported counts, 16.16 fixed point) read at the given micros() time.
+    // Returns true if fast changed.
+    bool update(int32_t x, int32_t y, uint32_t time);
+
+    // True if the sensors should be at the lower CPI.
+    bool fast;
+
+private:
+    // Running total of distance, in reported counts (16.16 fixed point).
+    uint32_t distance;
+    uint32_t last_time;
+    uint32_t switch_time;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+// Signed 16.16 fixed point number.
+// This is used in place of float for the motion math on boards without an FPU (i.e. the SAMD21),
+// where every float operation is a call into the software floating point library.
+class fixed16
+{
+public:
+	int32_t raw;
+
+	// Values outside the range (about +/-32768) saturate, rather than wrapping (or being undefined, for float and double).
+	// The range is symmetric, so negating a saturated value can't overflow either.
+	constexpr fixed16() : raw(0) {}
+	constexpr fixed16(int i) : raw((i > 32767)?INT32_MAX:((i < -32767)?-INT32_MAX:int32_t(i) * 65536)) {}
+	constexpr fixed16(float f) : raw((f >= 32768.0f)?INT32_MAX:((f <= -32768.0f)?-INT32_MAX:int32_t(f * 65536.0f + ((f < 0)?-0.5f:0.5f)))) {}
+	constexpr fixed16(double d) : raw((d >= 32768.0)?INT32_MAX:((d <= -32768.0)?-INT32_MAX:int32_t(d * 65536.0 + ((d < 0)?-0.5:0.5)))) {}
+
+	static fixed16 from_raw(int32_t r)
+	{
+		fixed16 result;
+		result.raw = r;
+		return result;
+	}
+
+	// Like float, conversion to int truncates toward zero.
+	explicit operator int() const { return (raw < 0)?-(-raw >> 16):(raw >> 16); }
+	explicit operator float() const { return raw / 65536.0f; }
+
+	fixed16 operator-() const { return from_raw(-raw); }
+	fixed16 operator+(const fixed16 &other) const { return from_raw(raw + other.raw); }
+	fixed16 operator-(const fixed16 &other) const { return from_raw(raw - other.raw); }
+	fixed16 operator*(const fixed16 &other) const { return from_raw(int32_t((int64_t(raw) * other.raw) >> 16)); }
+	fixed16 operator*(int scale) const { return from_raw(raw * scale); }
+	fixed16 operator/(int divisor) const { return from_raw(raw / divisor); }
+	void operator+=(const fixed16 &other) { raw += other.raw; }
+	void operator-=(const fixed16 &other) { raw -= other.raw; }
+
+	bool operator==(const fixed16 &other) const { return raw == other.raw; }
+	bool operator!=(const fixed16 &other) const { return raw != other.raw; }
+	bool operator<(const fixed16 &other) const { return raw < other.raw; }
+	bool operator>(const fixed16 &other) const { return raw > other.raw; }
+};
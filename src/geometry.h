@@ -0,0 +1,158 @@
+#pragma once
+
+// Works out the sensor transform from where the sensors sit on the ball, at compile time.
+//
+// Everything here is constexpr (and C++11 constexpr at that, so each function is a single expression),
+// so the transform ends up as a table of constants, with no trig or matrix math at runtime.
+//
+// The model:
+// The ball is a unit sphere centered at the origin, with +x to the right, +y away from the user, and +z up.
+// Each sensor sees the velocity of the surface underneath it (w x r, for ball rotation w and sensor position r).
+// With the sensor's rotation at 0, its X axis points down the surface of the ball (toward the bottom),
+// and its Y axis points along the surface, clockwise as seen from above.
+// The outputs are X = w.y (the top of the ball moving right), Y = w.x (the top of the ball moving toward the user),
+// and Z = w.z (twisting the ball).
+// All of these are surface motion on the same ball, so the size of the ball cancels out.
+
+struct sensor_position
+{
+	// Degrees clockwise from 12 o'clock (directly away from the user)
+	double azimuth;
+	// Degrees down from horizontal
+	double elevation;
+	// Degrees the sensor is rotated about its own axis, turning its X axis toward its Y axis.
+	double rotation;
+};
+
+constexpr double geometry_pi = 3.14159265358979323846;
+
+constexpr double geometry_sin_series(double term, double x2, int n)
+{
+	return (n == 12)?term:(term + geometry_sin_series(-term * x2 / ((2 * n + 2) * (2 * n + 3)), x2, n + 1));
+}
+
+constexpr double geometry_reduce(double radians)
+{
+	return (radians > geometry_pi)?geometry_reduce(radians - 2 * geometry_pi)
+		:((radians < -geometry_pi)?geometry_reduce(radians + 2 * geometry_pi):radians);
+}
+
+constexpr double geometry_sin_radians(double radians)
+{
+	return geometry_sin_series(radians, radians * radians, 0);
+}
+
+constexpr double geometry_sin(double degrees)
+{
+	return geometry_sin_radians(geometry_reduce(degrees * geometry_pi / 180));
+}
+
+constexpr double geometry_cos(double degrees)
+{
+	return geometry_sin(degrees + 90);
+}
+
+// Component (0 = x, 1 = y, 2 = z) of the sensor's position on the ball.
+constexpr double geometry_position(sensor_position s, int component)
+{
+	return (component == 0)?(geometry_sin(s.azimuth) * geometry_cos(s.elevation))
+		:((component == 1)?(geometry_cos(s.azimuth) * geometry_cos(s.elevation))
+		:-geometry_sin(s.elevation));
+}
+
+// Unit vectors along the surface at the sensor: down toward the bottom of the ball, and clockwise as seen from above.
+constexpr double geometry_down(sensor_position s, int component)
+{
+	return (component == 0)?(-geometry_sin(s.azimuth) * geometry_sin(s.elevation))
+		:((component == 1)?(-geometry_cos(s.azimuth) * geometry_sin(s.elevation))
+		:-geometry_cos(s.elevation));
+}
+
+constexpr double geometry_clockwise(sensor_position s, int component)
+{
+	return (component == 0)?geometry_cos(s.azimuth)
+		:((component == 1)?-geometry_sin(s.azimuth)
+		:0);
+}
+
+// Component of the direction of one of the sensor's axes (0 = X, 1 = Y).
+constexpr double geometry_axis(sensor_position s, int axis, int component)
+{
+	return (axis == 0)
+		?((geometry_cos(s.rotation) * geometry_down(s, component)) + (geometry_sin(s.rotation) * geometry_clockwise(s, component)))
+		:((geometry_cos(s.rotation) * geometry_clockwise(s, component)) - (geometry_sin(s.rotation) * geometry_down(s, component)));
+}
+
+// Component of r x d, where r is the sensor's position and d is the direction of one of its axes.
+constexpr double geometry_cross(sensor_position s, int axis, int component)
+{
+	return (component == 0)?((geometry_position(s, 1) * geometry_axis(s, axis, 2)) - (geometry_position(s, 2) * geometry_axis(s, axis, 1)))
+		:((component == 1)?((geometry_position(s, 2) * geometry_axis(s, axis, 0)) - (geometry_position(s, 0) * geometry_axis(s, axis, 2)))
+		:((geometry_position(s, 0) * geometry_axis(s, axis, 1)) - (geometry_position(s, 1) * geometry_axis(s, axis, 0))));
+}
+
+// How much a sensor axis reads for one unit of output (0 = X, 1 = Y, 2 = Z).
+// (w x r) . d = w . (r x d), and X/Y are rotations about the y/x axes.
+constexpr double geometry_reading(sensor_position s, int axis, int output, double handedness)
+{
+	return (output == 0)?(handedness * geometry_cross(s, axis, 1))
+		:((output == 1)?geometry_cross(s, axis, 0)
+		:geometry_cross(s, axis, 2));
+}
+
+// The forward model M: reading (0-3 = s1.x, s1.y, s2.x, s2.y) for one unit of output.
+constexpr double geometry_model(sensor_position s1, sensor_position s2, double handedness, int reading, int output)
+{
+	return (reading < 2)?geometry_reading(s1, reading, output, handedness)
+		:geometry_reading(s2, reading - 2, output, handedness);
+}
+
+// N = transpose(M) * M
+constexpr double geometry_normal(sensor_position s1, sensor_position s2, double handedness, int row, int col)
+{
+	return (geometry_model(s1, s2, handedness, 0, row) * geometry_model(s1, s2, handedness, 0, col))
+		+ (geometry_model(s1, s2, handedness, 1, row) * geometry_model(s1, s2, handedness, 1, col))
+		+ (geometry_model(s1, s2, handedness, 2, row) * geometry_model(s1, s2, handedness, 2, col))
+		+ (geometry_model(s1, s2, handedness, 3, row) * geometry_model(s1, s2, handedness, 3, col));
+}
+
+// Cofactor of N, which is symmetric, so this is also the adjugate.
+constexpr double geometry_cofactor(sensor_position s1, sensor_position s2, double handedness, int row, int col)
+{
+	return (geometry_normal(s1, s2, handedness, (row + 1) % 3, (col + 1) % 3) * geometry_normal(s1, s2, handedness, (row + 2) % 3, (col + 2) % 3))
+		- (geometry_normal(s1, s2, handedness, (row + 1) % 3, (col + 2) % 3) * geometry_normal(s1, s2, handedness, (row + 2) % 3, (col + 1) % 3));
+}
+
+constexpr double geometry_determinant(sensor_position s1, sensor_position s2, double handedness)
+{
+	return (geometry_normal(s1, s2, handedness, 0, 0) * geometry_cofactor(s1, s2, handedness, 0, 0))
+		+ (geometry_normal(s1, s2, handedness, 0, 1) * geometry_cofactor(s1, s2, handedness, 0, 1))
+		+ (geometry_normal(s1, s2, handedness, 0, 2) * geometry_cofactor(s1, s2, handedness, 0, 2));
+}
+
+// The sensor transform: the least squares solution for [X, Y, Z] from [s1.x, s1.y, s2.x, s2.y],
+// which is inverse(N) * transpose(M).
+// handedness is -1 for a mirrored (left-handed) shell, which flips X.
+constexpr double geometry_transform(sensor_position s1, sensor_position s2, double handedness, int output, int reading)
+{
+	return ((geometry_cofactor(s1, s2, handedness, output, 0) * geometry_model(s1, s2, handedness, reading, 0))
+		+ (geometry_cofactor(s1, s2, handedness, output, 1) * geometry_model(s1, s2, handedness, reading, 1))
+		+ (geometry_cofactor(s1, s2, handedness, output, 2) * geometry_model(s1, s2, handedness, reading, 2)))
+		/ geometry_determinant(s1, s2, handedness);
+}
+
+// The transform from one sensor's [x, y] to [X, Y, Z], for when the other one can't be trusted.
+// One sensor can't see all 3 axes, so this assumes there's no twist (Z = 0), and inverts the 2x2 model for X/Y.
+constexpr double geometry_single_determinant(sensor_position s, double handedness)
+{
+	return (geometry_reading(s, 0, 0, handedness) * geometry_reading(s, 1, 1, handedness))
+		- (geometry_reading(s, 0, 1, handedness) * geometry_reading(s, 1, 0, handedness));
+}
+
+constexpr double geometry_single_transform(sensor_position s, double handedness, int output, int axis)
+{
+	return (output == 2)?0
+		:((output == axis)?geometry_reading(s, 1 - axis, 1 - output, handedness)
+		:-geometry_reading(s, output, axis, handedness))
+		/ geometry_single_determinant(s, handedness);
+}
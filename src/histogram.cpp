@@ -0,0 +1,109 @@
+#include <Arduino.h>
+
+#include "histogram.h"
+
+timing_histogram::timing_histogram()
+{
+  reset();
+}
+
+void timing_histogram::reset()
+{
+  count = 0;
+  min = ULONG_MAX;
+  max = 0;
+  for (int i = 0; i < bucket_count; i++)
+  {
+    buckets[i] = 0;
+  }
+}
+
+int timing_histogram::bucket_index(unsigned long micros)
+{
+  if (micros < 8)
+  {
+    return micros;
+  }
+
+  // The top bit gives the power of 2, and the next two bits pick one of 4 buckets within it.
+  int top = 31 - __builtin_clz((uint32_t)micros);
+  int index = 8 + ((top - 3) * 4) + ((micros >> (top - 2)) & 3);
+  return (index < bucket_count)?index:(bucket_count - 1);
+}
+
+unsigned long timing_histogram::bucket_low(int index)
+{
+  if (index < 8)
+  {
+    return index;
+  }
+  int top = ((index - 8) / 4) + 3;
+  int sub = (index - 8) % 4;
+  return (unsigned long)(4 + sub) << (top - 2);
+}
+
+unsigned long timing_histogram::bucket_high(int index)
+{
+  if (index < 8)
+  {
+    return index;
+  }
+  int top = ((index - 8) / 4) + 3;
+  return bucket_low(index) + (1UL << (top - 2)) - 1;
+}
+
+void timing_histogram::add(unsigned long micros)
+{
+  buckets[bucket_index(micros)]++;
+  count++;
+  if (micros < min)
+  {
+    min = micros;
+  }
+  if (micros > max)
+  {
+    max = micros;
+  }
+}
+
+unsigned long timing_histogram::percentile(int pct)
+{
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  // Smallest number of samples that has to be at or below the result.
+  // count is 32 bits, so after about 43 million samples (12 hours at 1000Hz) count * pct would overflow it.
+  unsigned long target = (unsigned long)((((uint64_t)count * pct) + 99) / 100);
+  unsigned long seen = 0;
+  for (int i = 0; i < bucket_count; i++)
+  {
+    seen += buckets[i];
+    if (seen >= target)
+    {
+      unsigned long result = bucket_high(i);
+      return (result < max)?result:max;
+    }
+  }
+  return max;
+}
+
+void timing_histogram::print(Print &p, const char *name)
+{
+  if (count == 0)
+  {
+    p.printf("%s: no samples\n", name);
+    return;
+  }
+
+  p.printf("%s: count %lu, min %lu us, p50 %lu us, p99 %lu us, max %lu us\n",
+    name, count, min, percentile(50), percentile(99), max);
+  for (int i = 0; i < bucket_count; i++)
+  {
+    if (buckets[i] != 0)
+    {
+      p.printf("  %lu-%lu us: %lu\n", bucket_low(i), bucket_high(i), buckets[i]);
+    }
+  }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+// Fixed-bucket histogram of durations, in microseconds.
+// Buckets are exact up to 8us, and above that there are 4 per power of 2 (so each one is within 25% of its value),
+// which covers everything up to about 16 seconds in a few hundred bytes.
+// add() is cheap enough to call on every pass through loop().
+class timing_histogram
+{
+public:
+    timing_histogram();
+
+    void add(unsigned long micros);
+    void reset();
+
+    unsigned long count;
+    unsigned long min;
+    unsigned long max;
+
+    // Returns the upper bound of the bucket containing the given percentile (i.e. 99 for p99).
+    unsigned long percentile(int pct);
+
+    // Prints a summary line, followed by a line for each non-empty bucket.
+    void print(Print &p, const char *name);
+
+private:
+    enum { bucket_count = 8 + (22 * 4) };
+    unsigned long buckets[bucket_count];
+
+    static int bucket_index(unsigned long micros);
+    static unsigned long bucket_low(int index);
+    static unsigned long bucket_high(int index);
+};
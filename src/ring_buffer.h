@@ -0,0 +1,48 @@
+#pragma once
+
+// Fixed-size single-producer, single-consumer queue.
+// One core (or an interrupt handler) calls push(), and one other calls pop(). Neither ever waits for the other.
+// size must be a power of 2. The queue holds at most size - 1 items.
+template <class T, unsigned int size>
+class ring_buffer
+{
+public:
+	ring_buffer() : head(0), tail(0) {}
+
+	// Producer side. Returns false (and drops nothing) if the queue is full.
+	bool push(const T &item)
+	{
+		unsigned int h = head;
+		unsigned int next = (h + 1) & (size - 1);
+		if (next == __atomic_load_n(&tail, __ATOMIC_ACQUIRE))
+			return false;
+		items[h] = item;
+		// The item has to be in place before the consumer can see the new head.
+		__atomic_store_n(&head, next, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	// Consumer side. Returns false if the queue is empty.
+	bool pop(T &item)
+	{
+		unsigned int t = tail;
+		if (t == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+			return false;
+		item = items[t];
+		// Likewise, the item has to be copied out before the producer can reuse the slot.
+		__atomic_store_n(&tail, (t + 1) & (size - 1), __ATOMIC_RELEASE);
+		return true;
+	}
+
+	bool empty() const
+	{
+		return __atomic_load_n(&head, __ATOMIC_ACQUIRE) == __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+	}
+
+private:
+	static_assert((size & (size - 1)) == 0, "ring_buffer size must be a power of 2");
+
+	T items[size];
+	unsigned int head;
+	unsigned int tail;
+};
@@ -0,0 +1,149 @@
+#include <Arduino.h>
+#include <Adafruit_TinyUSB.h>
+
+#if defined(ARDUINO_ARCH_RP2040)
+  #include <hardware/structs/usb.h>
+#endif
+
+#include "scheduler.h"
+
+// Frame numbers on the bus are 11 bits. 2048 is a multiple of every supported interval,
+// so the position within an interval is still correct when the frame number wraps.
+static const int frame_mask = 0x7ff;
+static const unsigned long frame_micros = 1000;
+
+// Extra time allowed between a report being queued and the host's IN poll.
+static const unsigned long sample_margin_micros = 150;
+
+// Returns the frame number from the last SOF the USB peripheral saw, or -1 if there's no way to read it on this board.
+static int read_frame_number()
+{
+#if defined(ARDUINO_ARCH_RP2040)
+  return usb_hw->sof_rd & USB_SOF_RD_BITS;
+#elif defined(ARDUINO_ARCH_SAMD)
+  return USB->DEVICE.FNUM.bit.FNUM;
+#else
+  return -1;
+#endif
+}
+
+report_scheduler::report_scheduler(int report_hz)
+{
+  // Round to a supported interval.
+  interval_frames = 8;
+  while (interval_frames > 1 && (1000 / interval_frames) < report_hz)
+  {
+    interval_frames /= 2;
+  }
+
+  frame = 0;
+  hardware_frame = -1;
+  frame_start = 0;
+
+  // Until the host has taken a report, assume it polls in the middle of a frame.
+  in_position = frame_micros / 2;
+  build_micros = 0;
+  sample_position = in_position - sample_margin_micros;
+  last_offset = 0;
+
+  report_pending = false;
+  pending_sample_start = 0;
+  latency_micros = 0;
+  reset_latency();
+}
+
+void report_scheduler::reset_latency()
+{
+  latency_min = ULONG_MAX;
+  latency_max = 0;
+}
+
+void report_scheduler::update_frame(unsigned long now)
+{
+  int hw = read_frame_number();
+  if (hw >= 0 && hw != hardware_frame)
+  {
+    // New SOF
+    hardware_frame = hw;
+    frame = hw;
+    frame_start = now;
+    return;
+  }
+
+  // No SOF for longer than a frame (or no way to see them).
+  // Keep counting frames with micros(), so loop() keeps running while the bus is suspended.
+  // If there is a frame counter, give it some slack before taking over.
+  unsigned long timeout = (hw >= 0)?(frame_micros + (frame_micros / 2)):frame_micros;
+  while (now - frame_start >= timeout)
+  {
+    frame = (frame + 1) & frame_mask;
+    frame_start += frame_micros;
+  }
+}
+
+unsigned long report_scheduler::position(unsigned long now)
+{
+  unsigned long into_frame = now - frame_start;
+  if (into_frame >= frame_micros)
+  {
+    into_frame = frame_micros - 1;
+  }
+  return ((frame % interval_frames) * frame_micros) + into_frame;
+}
+
+void report_scheduler::update_sample_position()
+{
+  // Sample early enough that the report is queued a little before the host comes looking for it.
+  unsigned long period = interval_frames * frame_micros;
+  unsigned long lead = (build_micros + sample_margin_micros) % period;
+  sample_position = (in_position + period - lead) % period;
+}
+
+void report_scheduler::check_report_taken(unsigned long now)
+{
+  if (report_pending && tud_hid_ready())
+  {
+    // The host has taken the last report.
+    // This is only noticed the next time through loop(), but loop() spins between samples, so that's not long.
+    report_pending = false;
+
+    latency_micros = now - pending_sample_start;
+    if (latency_micros < latency_min)
+    {
+      latency_min = latency_micros;
+    }
+    if (latency_micros > latency_max)
+    {
+      latency_max = latency_micros;
+    }
+
+    in_position = position(now);
+    update_sample_position();
+  }
+}
+
+bool report_scheduler::sample_due()
+{
+  unsigned long now = micros();
+  update_frame(now);
+  check_report_taken(now);
+
+  // Measure the position relative to the sample point, so it wraps around to zero as the sample point passes.
+  unsigned long period = interval_frames * frame_micros;
+  unsigned long offset = (position(now) + period - sample_position) % period;
+  bool due = offset < last_offset;
+  last_offset = offset;
+
+  return due;
+}
+
+void report_scheduler::report_queued(unsigned long sample_start)
+{
+  // Smooth the build time a bit, so one slow loop doesn't throw off the schedule.
+  unsigned long elapsed = micros() - sample_start;
+  build_micros = ((build_micros * 3) + elapsed) / 4;
+  update_sample_position();
+
+  report_pending = true;
+  pending_sample_start = sample_start;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+// Decides when loop() should sample the sensors and build a report, so that the report is ready
+// just before the host's next IN poll instead of at some arbitrary point in the polling interval.
+//
+// Time is tracked in USB frames (one per millisecond, marked by the host's start-of-frame packets).
+// The frame number is read from the USB peripheral, so this stays locked to the host's clock.
+// Each time the host takes a report, the frame and offset within the frame are noted, and the next
+// sample is scheduled for that point in the following interval, less the time it takes to build a report.
+// While the bus is suspended there are no SOFs, and this falls back to counting frames with micros().
+class report_scheduler
+{
+public:
+    // report_hz must be 125, 250, 500, or 1000 (the host polls every 8, 4, 2, or 1 frames).
+    report_scheduler(int report_hz);
+
+    // The HID poll interval to put in the endpoint descriptor, in milliseconds.
+    int poll_interval() { return interval_frames; };
+
+    // Call this every time through loop(). It returns true once per interval, when it's time to sample.
+    // It doesn't wait, so the caller can do other work (like servicing the sensors) until it returns true.
+    bool sample_due();
+
+    // Call this when a report built from a sample taken at sample_start (a micros() timestamp)
+    // has been handed to TinyUSB.
+    void report_queued(unsigned long sample_start);
+
+    // Measured time from the start of the sample to the host taking the report, for the most recent report,
+    // and the minimum/maximum seen since the last call to reset_latency(), in microseconds.
+    unsigned long latency_micros;
+    unsigned long latency_min;
+    unsigned long latency_max;
+    void reset_latency();
+
+private:
+    void update_frame(unsigned long now);
+    void check_report_taken(unsigned long now);
+    void update_sample_position();
+    // Microseconds since the start of the current interval.
+    unsigned long position(unsigned long now);
+
+    int interval_frames;
+
+    // Current frame number (11 bits, as on the bus), and the micros() timestamp of its start.
+    int frame;
+    int hardware_frame;
+    unsigned long frame_start;
+
+    // Where in the interval the host last took a report (in microseconds from the start of a frame
+    // whose number is a multiple of interval_frames), and when to sample relative to that.
+    unsigned long in_position;
+    unsigned long sample_position;
+    unsigned long last_offset;
+
+    // Time it takes from the start of a sample to the report being queued.
+    unsigned long build_micros;
+
+    // Set from report_queued() until the host takes the report.
+    bool report_pending;
+    unsigned long pending_sample_start;
+};
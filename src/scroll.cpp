@@ -0,0 +1,109 @@
+#include <Arduino.h>
+
+#include "scroll.h"
+
+// Momentum starts after a twist faster than this, and stops when it slows to this, in detents per second.
+static const float coast_start_detents = 8.0f;
+static const float coast_stop_detents = 1.0f;
+// Time for the momentum to slow to about a third of its starting speed.
+static const float coast_time_constant = 0.4f;
+// Minimum time between clicks.
+static const int click_interval_ms = 30;
+
+static int32_t abs32(int32_t x)
+{
+  return (x < 0)?-x:x;
+}
+
+scroll_engine::scroll_engine(int counts_per_detent, int steps_per_detent, int frame_hz, bool momentum)
+{
+  this->counts_per_detent = counts_per_detent;
+  this->steps_per_detent = steps_per_detent;
+  this->momentum = momentum;
+
+  position = 0;
+  input = 0;
+  have_input = false;
+  velocity = 0;
+  coast = false;
+
+  // Convert the settings to per-frame values. This only happens once, so float is fine here.
+  float counts_per_frame = float(counts_per_detent) / frame_hz;
+  coast_start = int32_t(coast_start_detents * counts_per_frame * 65536.0f);
+  coast_stop = int32_t(coast_stop_detents * counts_per_frame * 65536.0f);
+  decay = int32_t(expf(-1.0f / (coast_time_constant * frame_hz)) * 65536.0f);
+
+  click_steps = 0;
+  click_frames = 0;
+  click_interval = (click_interval_ms * frame_hz) / 1000;
+}
+
+void scroll_engine::add(int32_t counts_q16)
+{
+  input += counts_q16;
+  have_input = true;
+}
+
+void scroll_engine::cancel()
+{
+  coast = false;
+  velocity = 0;
+}
+
+int scroll_engine::update(bool hires, bool &click)
+{
+  if (have_input)
+  {
+    // The ball is being turned. Track its speed, in case it's let go.
+    position += input;
+    velocity = (velocity + input) / 2;
+    coast = false;
+  }
+  else if (coast)
+  {
+    position += velocity;
+    velocity = int32_t((int64_t(velocity) * decay) >> 16);
+    if (abs32(velocity) < coast_stop)
+    {
+      cancel();
+    }
+  }
+  else if (momentum && abs32(velocity) >= coast_start)
+  {
+    // The ball was let go while it was moving fast.
+    coast = true;
+    position += velocity;
+  }
+  else
+  {
+    velocity = 0;
+  }
+  input = 0;
+  have_input = false;
+
+  // Report whole steps, and keep the remainder for next time.
+  int steps = hires?steps_per_detent:1;
+  int32_t step = (int32_t(counts_per_detent) << 16) / steps;
+  int result = position / step;
+  position -= result * step;
+
+  // Click once per detent, but not more often than click_interval.
+  click = false;
+  if (click_frames > 0)
+  {
+    click_frames--;
+  }
+  click_steps += result;
+  int detents = click_steps / steps;
+  if (detents != 0)
+  {
+    click_steps -= detents * steps;
+    if (click_frames == 0)
+    {
+      click = true;
+      click_frames = click_interval;
+    }
+  }
+
+  return result;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+// Turns twist motion into wheel movement.
+//
+// Motion is accumulated in sensor counts (16.16 fixed point) and reported in steps of counts_per_detent / steps_per_detent
+// when the host has turned on the wheel's resolution multiplier, or in whole detents when it hasn't.
+// Since a report can carry many steps, a long spin doesn't need a report per detent.
+//
+// With momentum turned on, a fast twist keeps scrolling after the ball stops, slowing down a little every frame,
+// until the ball is touched again or it gets slow enough to stop.
+//
+// The piezo click is rate limited, so a long spin doesn't queue up a tone() for every detent.
+class scroll_engine
+{
+public:
+    // frame_hz is how often update() is called.
+    scroll_engine(int counts_per_detent, int steps_per_detent, int frame_hz, bool momentum);
+
+    // Adds twist motion that was classified as scrolling, in counts (16.16 fixed point).
+    void add(int32_t counts_q16);
+
+    // Stops any momentum scrolling (i.e. because the ball was moved some other way, or a button was pressed).
+    void cancel();
+
+    // Call this once per frame. Returns the number of steps to report (detents, or fractions of one if hires is set).
+    // click is set if the piezo should click.
+    int update(bool hires, bool &click);
+
+    bool coasting() { return coast; }
+
+private:
+    int counts_per_detent;
+    int steps_per_detent;
+    bool momentum;
+
+    // Counts that haven't been reported yet.
+    int32_t position;
+    // Motion added since the last update().
+    int32_t input;
+    bool have_input;
+
+    // Smoothed scroll speed in counts per frame, and whether it's carrying on by itself.
+    int32_t velocity;
+    bool coast;
+
+    // Momentum settings, in 16.16 counts per frame (and the per-frame decay factor).
+    int32_t coast_start;
+    int32_t coast_stop;
+    int32_t decay;
+
+    // Steps that haven't been clicked for yet, and frames until the next click is allowed.
+    int click_steps;
+    int click_frames;
+    int click_interval;
+};
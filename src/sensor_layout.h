@@ -0,0 +1,33 @@
+#pragma once
+
+#include "geometry.h"
+
+// Where the sensors sit on the ball. The sensor transform is worked out from these at compile time (see geometry.h).
+// These are in their own header so the host tests can replay motion traces through the same transform the firmware uses.
+
+// The coordinate system here is a bit wonky -- in the final HID report, +X points right and +Y points "down" (towards the user),
+// and the direction of Z is arbitrary since we're translating it to scrollwheel ticks.
+// We're also conflating linear motion on the X/Y plane of each sensor tangent to the ball with rotation of the ball in X/Y/Z
+
+// sensor locations:
+// S#A = azimuth = degrees clockwise from 12 o'clock (directly away from the user)
+// S#E = elevation = degrees down from horizontal
+// S#R = rotation = degrees the sensor is turned about its own axis, from X pointing down the ball and Y pointing clockwise
+// Note that the sensor orientation I've been using all along is actually "sideways", for mechanical reasons
+// i.e. the X axis of the sensor points up/down, and the Y axis points parallel to the desk. That's rotation 0.
+#define S1A 180
+#define S1E 30
+#define S1R 0
+#define S2A (270 + 45)
+#define S2E 30
+#define S2R 0
+
+// For the left-handed version, the main body has been mirrored, which flips X.
+#if !defined(LEFT_HANDED)
+  constexpr double handedness = 1;
+#else
+  constexpr double handedness = -1;
+#endif
+
+constexpr sensor_position s1_position = { S1A, S1E, S1R };
+constexpr sensor_position s2_position = { S2A, S2E, S2R };
@@ -6,6 +6,18 @@
 #include "trackball.h"
 #include "Vector.h"
 #include "adns.h"
+#include "scheduler.h"
+#include "ring_buffer.h"
+#include "histogram.h"
+#include "buttons.h"
+#include "coalescer.h"
+#include "scroll.h"
+#include "classifier.h"
+#include "geometry.h"
+#include "sensor_layout.h"
+#include "calibration.h"
+#include "acceleration.h"
+#include "dynamic_cpi.h"
 
 #if defined(PIN_NEOPIXEL)
   #include <Adafruit_NeoPixel.h>
@@ -19,18 +31,44 @@
 const int reported_cpi = 800;
 
 // This is the frequency at which we poll sensors/buttons and send HID reports.
-const int report_Hz = 120;
+// It's also the HID polling rate requested from the host, so it should be 125, 250, 500, or 1000.
+// At 1000, everything done for a report (both sensor bursts, the buttons, the transform, and queueing the report)
+// has to fit in 1ms. Use STAGE_HISTOGRAMS to check.
+// By the datasheet numbers, each burst is about 100us of that at the 2MHz burst clock: 35us of tSRAD_MOTBR,
+// 56us to clock out the 14 burst bytes, and tBEXIT plus the chip select edges.
+#if !defined(REPORT_HZ)
+  #define REPORT_HZ 125
+#endif
+const int report_Hz = REPORT_HZ;
+
+// Turn this on to log the measured time from sampling the sensors to the host taking the report.
+// #define LOG_REPORT_LATENCY
+
+// Turn this on to keep a histogram of the time taken by each stage of building a report.
+// Type 'h' on the serial port to print them, or 'r' to clear them. This works without SERIAL_DEBUG.
+// #define STAGE_HISTOGRAMS
+
+// Turn this on (rp2040 only) to read the sensors on the second core.
+// Core1 polls the sensors continuously and passes the transformed motion to core0 through a queue,
+// and core0 handles the buttons, USB reports, the display, and the LEDs.
+// #define DUAL_CORE
 
-// Use a custom HID descriptor instead of TUD_HID_REPORT_DESC_MOUSE()
-#define USE_CUSTOM_HID_DESCRIPTOR 0
+// Turn this on to keep scrolling for a moment after a fast twist of the ball.
+// #define SCROLL_MOMENTUM
 
-// Use HID_USAGE_DESKTOP_RESOLUTION_MULTIPLIER to transmit higher-fidelity scroll reports.
-// Only used if USE_CUSTOM_HID_DESCRIPTOR is also set to 1.
-#define USE_SCROLL_RESOLUTION_MULTIPLIER 0
+// Turn this on to log every sensor sample (after scaling, before the transform) for replaying on the host.
+// Each line is "trace <micros> <v1.x> <v1.y> <v2.x> <v2.y>", with the motion in 16.16 fixed point.
+// #define LOG_MOTION_TRACE
 
-// Use 16 bit fields for the X/Y deltas in the report
-// Only used if USE_CUSTOM_HID_DESCRIPTOR is also set to 1.
-#define USE_16_BIT_DELTAS 1
+// Use our own HID descriptor instead of TUD_HID_REPORT_DESC_MOUSE().
+// It has 16 bit X/Y deltas, and a resolution multiplier for the wheel, which hosts that support it will turn on.
+// Either way, the device also supports the boot protocol, if the host asks for it.
+#if !defined(USE_CUSTOM_HID_DESCRIPTOR)
+  #define USE_CUSTOM_HID_DESCRIPTOR 1
+#endif
+
+// When the host turns on the resolution multiplier, the wheel is reported in this many steps per detent.
+const int scroll_resolution = 8;
 
 // Enable serial port debugging output
 // #define SERIAL_DEBUG
@@ -46,12 +84,74 @@ const int report_Hz = 120;
 // Only used if SENSOR_DISPLAY is non-zero
 // #define SENSOR_DISPLAY_ON_STARTUP
 
+// Button debounce times, in microseconds.
+// A press is reported as soon as the switch closes, and then held for at least BUTTON_PRESS_MICROS.
+// A release is reported once the switch has stayed open for BUTTON_RELEASE_MICROS, so this adds to the release latency.
+#if !defined(BUTTON_PRESS_MICROS)
+  #define BUTTON_PRESS_MICROS 10000
+#endif
+#if !defined(BUTTON_RELEASE_MICROS)
+  #define BUTTON_RELEASE_MICROS 5000
+#endif
+
+// What the function button does, on boards that have one:
+// 1 - precision mode: pointer motion is divided by FUNCTION_PRECISION_DIVISOR while the button is held
+// 2 - toggles sensor display mode (if there's a display)
+// 3 - cycles through acceleration_presets (if POINTER_ACCELERATION is on)
+#if !defined(FUNCTION_BUTTON_ACTION)
+  #define FUNCTION_BUTTON_ACTION 1
+#endif
+#if !defined(FUNCTION_PRECISION_DIVISOR)
+  #define FUNCTION_PRECISION_DIVISOR 4
+#endif
+
+// Set this to 1 to drop the sensors to DYNAMIC_CPI_LOW during fast movements, and run them at their maximum CPI otherwise.
+// The switching speeds are in dynamic_cpi.cpp.
+// This is off by default. It changes the sensor settings existing builds run with, and nothing has measured it doing any good yet.
+#if !defined(DYNAMIC_CPI)
+  #define DYNAMIC_CPI 0
+#endif
+#if !defined(DYNAMIC_CPI_LOW)
+  #define DYNAMIC_CPI_LOW 3200
+#endif
+
+// Turn this on to apply pointer acceleration on the device (see acceleration.h), instead of leaving it up to the host.
+// You'll want to turn off acceleration on the host if you do this, or they'll stack.
+// #define POINTER_ACCELERATION
+// Which of acceleration_presets to start with.
+#if !defined(ACCELERATION_PRESET)
+  #define ACCELERATION_PRESET 1
+#endif
+
 // Turn this on to make the LED light up when buttons are pressed, and fade when they're released.
 // #define BUTTON_LIGHTS
 
 // Turn this on to adjust the sensor transform for a left-handed version.
 // #define LEFT_HANDED
 
+// Set this to 1 to allow calibrating the sensor transform on the device, which is saved to flash.
+// Holding the left and right buttons together for CALIBRATION_CHORD_MILLIS starts it.
+// Then roll the ball left and right, click left, roll it up and down, click left, twist it, and click left to finish.
+// Clicking right at any point cancels, and clicking middle goes back to the built-in transform (and forgets the saved one).
+// While this is on, the host never sees left and right down together (so that chord can't be used for anything else).
+// On the SAMD21 boards, this also needs the FlashStorage library (see the commented out line in platformio.ini).
+#if !defined(TRANSFORM_CALIBRATION)
+  #define TRANSFORM_CALIBRATION 0
+#endif
+#if !defined(CALIBRATION_CHORD_MILLIS)
+  #define CALIBRATION_CHORD_MILLIS 3000
+#endif
+
+// Element type for the motion math in loop(). Set this to 1 to use 16.16 fixed point instead of float.
+// This is worth doing on boards without an FPU (the SAMD21 boards turn it on in platformio.ini).
+#if !defined(MOTION_FIXED_POINT)
+  #define MOTION_FIXED_POINT 0
+#endif
+
+// If all the sensors are the same model, set this to its description from adns.h (i.e. adns_pmw3360dm).
+// The sensor details are then fixed at compile time, and the firmware for the other models is left out of the build.
+// #define SENSOR_MODEL adns_pmw3360dm
+
 // Turn this on to override the default device name used in the device descriptor
 // #define DEVICE_NAME FooBall
 
@@ -67,6 +167,16 @@ const int report_Hz = 120;
   #include <Adafruit_SSD1351.h>
 #endif
 
+#if TRANSFORM_CALIBRATION
+  #if defined(ARDUINO_ARCH_RP2040)
+    #include <EEPROM.h>
+  #elif defined(ARDUINO_ARCH_SAMD)
+    #include <FlashStorage.h>
+  #else
+    #error TRANSFORM_CALIBRATION needs a way to save to flash on this board
+  #endif
+#endif
+
 
 /*
   Common pin assignments:
@@ -108,6 +218,12 @@ const int report_Hz = 120;
     #define PIN_SENSOR_2_SELECT A6  
   #endif
 
+  // Optional motion pins for sensors (the MOT output on the sensor). 
+  // When these are defined, the sensor is only read after it signals motion.
+  // There aren't any spare pins on this board unless the display isn't being used, in which case SDA/SCL are free.
+  // #define PIN_SENSOR_1_MOTION PIN_WIRE_SDA
+  // #define PIN_SENSOR_2_MOTION PIN_WIRE_SCL
+
   // Testing: use software SPI
   // #define SENSOR_1_SOFTWARE_SPI     PIN_SPI_SCK, PIN_SPI_MISO, PIN_SPI_MOSI
   // #define SENSOR_2_SOFTWARE_SPI     PIN_SPI_SCK, PIN_SPI_MISO, PIN_SPI_MOSI
@@ -133,6 +249,10 @@ const int report_Hz = 120;
   #define PIN_BUTTON_LEFT PIN_B16 
   #define PIN_BUTTON_RIGHT PIN_B17 
   #define PIN_BUTTON_MIDDLE PIN_B18 
+  // The extra button connectors are back, forward, and the function button.
+  #define PIN_BUTTON_BACK PIN_B19
+  #define PIN_BUTTON_FORWARD PIN_B20
+  #define PIN_BUTTON_FUNCTION PIN_B21
 
   // SPI Select pins for sensors
 
@@ -140,12 +260,16 @@ const int report_Hz = 120;
   // hardware SPI on SPI0.8 connector
   #define PIN_SENSOR_1_SELECT PIN_SPI0_SS08
   #define SENSOR_1_SPI_DEVICE SPI
+  // The sensor connectors don't carry the MOT signal. 
+  // If it's wired to the breakout connector, define these to only read sensors after they signal motion.
+  // #define PIN_SENSOR_1_MOTION PIN_BREAKOUT1
 
   // sensor 2
 #if 1
   // hardware SPI on SPI0.9 connector
   #define PIN_SENSOR_2_SELECT PIN_SPI0_SS09
   #define SENSOR_2_SPI_DEVICE SPI
+  // #define PIN_SENSOR_2_MOTION PIN_BREAKOUT2
 #elif 0
   // hardware SPI on SPI1.13 connector
   #define PIN_SENSOR_2_SELECT PIN_SPI1_SS
@@ -165,14 +289,43 @@ const int report_Hz = 120;
 
 #endif
 
-// Button state polling/tracking
-const char buttonNames[] = { MOUSE_BUTTON_LEFT, MOUSE_BUTTON_RIGHT, MOUSE_BUTTON_MIDDLE };
-const int buttonPins[] = { PIN_BUTTON_LEFT, PIN_BUTTON_RIGHT,  PIN_BUTTON_MIDDLE };
+// The motion pin is passed using the constructor that takes an SPI device.
+#if defined(PIN_SENSOR_1_MOTION) && !defined(SENSOR_1_SPI_DEVICE) && !defined(SENSOR_1_SOFTWARE_SPI)
+  #define SENSOR_1_SPI_DEVICE SPI
+#endif
+#if defined(PIN_SENSOR_2_MOTION) && !defined(SENSOR_2_SPI_DEVICE) && !defined(SENSOR_2_SOFTWARE_SPI)
+  #define SENSOR_2_SPI_DEVICE SPI
+#endif
+
+// Button state tracking
+// The function button isn't a HID button. It gets a bit in buttons that's masked out of the reports.
+const char button_function = char(0x80);
+const char buttonNames[] = 
+{ 
+  MOUSE_BUTTON_LEFT, MOUSE_BUTTON_RIGHT, MOUSE_BUTTON_MIDDLE,
+#if defined(PIN_BUTTON_BACK)
+  MOUSE_BUTTON_BACKWARD, MOUSE_BUTTON_FORWARD,
+#endif
+#if defined(PIN_BUTTON_FUNCTION)
+  button_function,
+#endif
+};
+const int buttonPins[] = 
+{ 
+  PIN_BUTTON_LEFT, PIN_BUTTON_RIGHT,  PIN_BUTTON_MIDDLE,
+#if defined(PIN_BUTTON_BACK)
+  PIN_BUTTON_BACK, PIN_BUTTON_FORWARD,
+#endif
+#if defined(PIN_BUTTON_FUNCTION)
+  PIN_BUTTON_FUNCTION,
+#endif
+};
 const int buttonCount = sizeof(buttonPins) / sizeof(buttonPins[0]);
+button_reader button_input(buttonPins, buttonNames, buttonCount, BUTTON_PRESS_MICROS, BUTTON_RELEASE_MICROS);
 char buttons;
 
-// HID report descriptor using TinyUSB's template
-// Single Report (no ID) descriptor
+// HID report descriptor
+// Single Report (no ID) descriptor, with an Input report for the mouse, and a Feature report for the wheel's resolution multiplier.
 uint8_t const desc_hid_report[] =
 {
 #if !USE_CUSTOM_HID_DESCRIPTOR
@@ -199,42 +352,42 @@ uint8_t const desc_hid_report[] =
         HID_REPORT_SIZE ( 3                                      ) ,
         HID_INPUT       ( HID_CONSTANT                           ) ,
       HID_USAGE_PAGE  ( HID_USAGE_PAGE_DESKTOP )                   ,
-        /* X, Y position [-127, 127] */ 
+        /* X, Y position [-32767, 32767] */ 
         HID_USAGE       ( HID_USAGE_DESKTOP_X                    ) ,
         HID_USAGE       ( HID_USAGE_DESKTOP_Y                    ) ,
-#if USE_16_BIT_DELTAS
         HID_LOGICAL_MIN_N ( SHRT_MIN, 2                          ) ,
         HID_LOGICAL_MAX_N ( SHRT_MAX, 2                          ) ,
         HID_REPORT_COUNT( 2                                      ) ,
         HID_REPORT_SIZE ( 16                                     ) ,
-#else
-        HID_LOGICAL_MIN ( 0x81                                   ) ,
-        HID_LOGICAL_MAX ( 0x7f                                   ) ,
-        HID_REPORT_COUNT( 2                                      ) ,
-        HID_REPORT_SIZE ( 8                                      ) ,
-#endif
         HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_RELATIVE ) ,
     HID_COLLECTION_END                                             , 
     HID_COLLECTION ( HID_COLLECTION_LOGICAL   )                    ,
-#if USE_SCROLL_RESOLUTION_MULTIPLIER
       HID_USAGE_PAGE  ( HID_USAGE_PAGE_DESKTOP )                   ,
+        /* Wheel resolution multiplier (Feature): 0 is 1 step per detent, 1 is scroll_resolution steps per detent */
+        /* This applies to the wheel below, since it's in the same logical collection. */
         HID_USAGE       ( HID_USAGE_DESKTOP_RESOLUTION_MULTIPLIER) ,
         HID_LOGICAL_MIN ( 0                                      ) ,
-        HID_LOGICAL_MAX ( 255                                    ) ,
+        HID_LOGICAL_MAX ( 1                                      ) ,
         HID_PHYSICAL_MIN( 1                                      ) ,
-        HID_PHYSICAL_MAX_N( 256, 2                               ) ,
+        HID_PHYSICAL_MAX( scroll_resolution                      ) ,
         HID_REPORT_COUNT( 1                                      ) ,
-        HID_REPORT_SIZE ( 8                                      ) ,
-        HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ) ,
-#endif
-      HID_USAGE_PAGE  ( HID_USAGE_PAGE_DESKTOP )                   ,
-        /* Veritcal wheel scroll [-127, 127] */ 
+        HID_REPORT_SIZE ( 2                                      ) ,
+        HID_FEATURE     ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ) ,
+        /* 6 bit padding */ 
+        HID_REPORT_SIZE ( 6                                      ) ,
+        HID_FEATURE     ( HID_CONSTANT                           ) ,
+        HID_PHYSICAL_MIN( 0                                      ) ,
+        HID_PHYSICAL_MAX( 0                                      ) ,
+        /* Vertical wheel scroll [-127, 127] */ 
         HID_USAGE       ( HID_USAGE_DESKTOP_WHEEL                )  ,
         HID_LOGICAL_MIN ( 0x81                                   )  ,
         HID_LOGICAL_MAX ( 0x7f                                   )  ,
         HID_REPORT_COUNT( 1                                      )  ,
         HID_REPORT_SIZE ( 8                                      )  ,
         HID_INPUT       ( HID_DATA | HID_VARIABLE | HID_RELATIVE )  ,
+    HID_COLLECTION_END                                            , 
+    /* Pan gets its own logical collection, so the multiplier doesn't apply to it. */
+    HID_COLLECTION ( HID_COLLECTION_LOGICAL   )                    ,
       HID_USAGE_PAGE  ( HID_USAGE_PAGE_CONSUMER ), 
        /* Horizontal wheel scroll [-127, 127] */ 
         HID_USAGE_N     ( HID_USAGE_CONSUMER_AC_PAN, 2           ), 
@@ -248,63 +401,177 @@ uint8_t const desc_hid_report[] =
 #endif
 };
 
+// Set when the host turns on the resolution multiplier. Scrolling is then reported in steps of 1/scroll_resolution of a detent.
+// This is written from TinyUSB's control request handling.
+volatile bool hires_scroll = false;
+
+// The host reads and writes the Feature report to find out about, and turn on, high resolution scrolling.
+uint16_t hid_get_report(uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen)
+{
+  if (report_type == HID_REPORT_TYPE_FEATURE && reqlen >= 1)
+  {
+    buffer[0] = hires_scroll?1:0;
+    return 1;
+  }
+  return 0;
+}
+
+void hid_set_report(uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize)
+{
+  if (report_type == HID_REPORT_TYPE_FEATURE && bufsize >= 1)
+  {
+    hires_scroll = ((buffer[0] & 0x03) != 0);
+  }
+}
+
 // USB HID object
 Adafruit_USBD_HID usb_hid;
 
-const int report_microseconds = 1000000 / report_Hz;
+// Decides when to sample the sensors, so the report is fresh when the host polls for it.
+report_scheduler scheduler(report_Hz);
 
-// The coordinate system here is a bit wonky -- in the final HID report, +X points right and +Y points "down" (towards the user),
-// and the direction of Z is arbitrary since we're translating it to scrollwheel ticks.
-// We're also conflating linear motion on the X/Y plane of each sensor tangent to the ball with rotation of the ball in X/Y/Z
+// Time taken by the last sample/report pass through loop(), saved so we can display it during the next one.
+unsigned long loop_time = 0;
 
-// sensor locations:
-// S#A = azimuth = degrees clockwise from 12 o'clock (directly away from the user)
-// S#E = elevation = degrees down from horizontal
-#define S1A 180
-#define S1E 30
-#define S2A (270 + 45)
-#define S2E 30
+#if defined(STAGE_HISTOGRAMS)
+  // Time taken by each stage of a pass through loop(), since the histograms were last cleared.
+  enum
+  {
+    stage_burst_1,
+    stage_burst_2,
+    stage_transform,
+    stage_scroll,
+    stage_acceleration,
+    stage_buttons,
+    stage_report,
+    stage_leds,
+    stage_total,
+    stage_button_latency,
+    stage_count
+  };
+  const char *const stage_names[stage_count] = 
+    { "sensor 1 burst", "sensor 2 burst", "transform", "scroll classification", "acceleration", "buttons", "report", "leds", "total", "button edge to report" };
+  timing_histogram stage_times[stage_count];
+  unsigned long stage_overruns = 0;
+
+  // Each function that times stages keeps its own mark, so this works the same when the sensors are read on core1.
+  // STAGE_END() adds the time since the mark to the stage's histogram and moves the mark up, so the next stage starts there.
+  // STAGE_RESTART() moves the mark up without recording anything.
+  #define STAGE_BEGIN(mark) unsigned long mark = micros()
+  #define STAGE_END(stage, mark) \
+    { \
+      unsigned long stage_now = micros(); \
+      stage_times[stage].add(stage_now - mark); \
+      mark = stage_now; \
+    }
+  #define STAGE_RESTART(mark) mark = micros()
+#else
+  #define STAGE_BEGIN(mark)
+  #define STAGE_END(stage, mark)
+  #define STAGE_RESTART(mark)
+#endif
 
-// TODO: build a transform from the azimuth/elevation constants.
+// The sensor locations are in sensor_layout.h.
 
-// The sensor transform
-// Note that the sensor orientation I've been using all along is actually "sideways", for mechanical reasons
-// i.e. the X axis of the sensor points up/down, and the Y axis points parallel to the desk.
-// This transform takes that into account.
-float st[3][4] = 
+#if MOTION_FIXED_POINT
+  typedef fixed16 motion_t;
+#else
+  typedef float motion_t;
+#endif
+typedef VectorT<motion_t> MotionVector;
+
+// The sensor transform, worked out from the sensor locations at compile time (see sensor_layout.h and geometry.h).
+// For the current sensor locations this comes out to roughly:
+//   { -0.28,  0.59, -0.70, -0.59 }
+//   {  0.70, -0.25, -0.30,  0.25 }
+//   {  0.12, -0.58, -0.12, -0.58 }
+// This uses all four readings for each axis, where the "hack" transform I'd been using before picked out one or two:
+//   { -1,  0,   -1.41,  0   }  // X is s2.x, scaled up a bit, with s1.x subtracted to compensate for s2 being off-axis
+//   {  1,  0,    0,     0   }  // Y is s1.x
+//   {  0, -0.5,  0,    -0.5 }  // Z is the average of the two sensors' y components.
+// st_geometry is constexpr, so if anything in the geometry can't be worked out at compile time, the build fails 
+// instead of quietly running the math at startup.
+// st is the one in use. With TRANSFORM_CALIBRATION, calibration can replace it at runtime, so it starts out as a copy of st_geometry.
+// Otherwise it never changes, so it's just another name for st_geometry, and the compiler can fold its coefficients into read_sensors().
+#define ST(output, reading) motion_t(geometry_transform(s1_position, s2_position, handedness, output, reading))
+constexpr motion_t st_geometry[3][4] =
+{
+  { ST(0, 0), ST(0, 1), ST(0, 2), ST(0, 3) },
+  { ST(1, 0), ST(1, 1), ST(1, 2), ST(1, 3) },
+  { ST(2, 0), ST(2, 1), ST(2, 2), ST(2, 3) }
+};
+#undef ST
+#if TRANSFORM_CALIBRATION
+#define ST(output, reading) st_geometry[output][reading]
+motion_t st[3][4] =
 {
-#if !defined(LEFT_HANDED)
-  // This is the "hack" transform I've been using for the new sensor location 
-  // (s1 at 180, s2 at  270 + 45, both at 30 degrees elevation)
-  { -1,        0,       -sqrtf(2.0),  0   },  // X is s2.x, scaled up a bit, with s1.x subtracted to compensate for s2 being off-axis
-  {  1,        0,        0,           0   },  // Y is s1.x
-  {  0,       -0.5,      0,          -0.5 }   // Z is the average of the two sensors' y components.
+  { ST(0, 0), ST(0, 1), ST(0, 2), ST(0, 3) },
+  { ST(1, 0), ST(1, 1), ST(1, 2), ST(1, 3) },
+  { ST(2, 0), ST(2, 1), ST(2, 2), ST(2, 3) }
+};
+#undef ST
 #else
-  // This is the transform for the left-handed version, where the main body has been mirrored.
-  {  1,        0,        sqrtf(2.0),  0   },  // X is s2.x, scaled up a bit, with s1.x subtracted to compensate for s2 being off-axis
-  {  1,        0,        0,           0   },  // Y is s1.x
-  {  0,       -0.5,      0,          -0.5 }   // Z is the average of the two sensors' y components.
+constexpr const motion_t (&st)[3][4] = st_geometry;
+#endif
+
+// Turn this on to use the sensors' surface quality readings (SQUAL, shutter, and lift) to decide how much to trust each one.
+// When one of them is having trouble (i.e. a speck of dust or a shiny patch on the ball), X/Y come from the other one alone.
+// This is off by default. It changes the pointer output existing builds give, and nothing has measured the thresholds below on a real ball yet.
+#if !defined(SENSOR_FUSION)
+  #define SENSOR_FUSION 0
 #endif
 
-  // This was the transform for the original sensor location (s1 at 180 and s2 at 270, at zero elevation)
-  // {  0,        0,       -1,     0   },    // X is the inverse of the direct x reading of s2
-  // {  1,        0,        0,     0   },    // Y is the direct x reading of s1
-  // {  0,       -0.5,      0,    -0.5  }    // Z is the average of the two sensors' y components.
+// A sensor's weight goes from nothing at fusion_squal_min to full at fusion_squal_good,
+// and it gets no weight if its shutter time goes over fusion_shutter_max, or it reports lift.
+const int fusion_squal_min = 8;
+const int fusion_squal_good = 24;
+const int fusion_shutter_max = 16000;
+
+// Transforms for when only one sensor can be trusted.
+// One sensor can't see all 3 axes, so these assume there's no twist (Z), and only solve for X/Y.
+// For the current sensor locations, s1 gives X = 2 * s1.y and Y = s1.x.
+#define ST_S1(output, axis) motion_t(geometry_single_transform(s1_position, handedness, output, axis))
+#define ST_S2(output, axis) motion_t(geometry_single_transform(s2_position, handedness, output, axis))
+constexpr motion_t st_s1[3][2] =
+{
+  { ST_S1(0, 0), ST_S1(0, 1) },
+  { ST_S1(1, 0), ST_S1(1, 1) },
+  { ST_S1(2, 0), ST_S1(2, 1) }
+};
+constexpr motion_t st_s2[3][2] =
+{
+  { ST_S2(0, 0), ST_S2(0, 1) },
+  { ST_S2(1, 0), ST_S2(1, 1) },
+  { ST_S2(2, 0), ST_S2(2, 1) }
 };
+#undef ST_S1
+#undef ST_S2
 
 // sensor hardware abstraction
-adns s1(PIN_SENSOR_1_SELECT, reported_cpi
+#if defined(SENSOR_MODEL)
+  typedef adns_fixed<SENSOR_MODEL> trackball_sensor;
+#else
+  typedef adns trackball_sensor;
+#endif
+
+trackball_sensor s1(PIN_SENSOR_1_SELECT, reported_cpi
 #if defined(SENSOR_1_SPI_DEVICE)
   , SENSOR_1_SPI_DEVICE
+  #if defined(PIN_SENSOR_1_MOTION)
+    , PIN_SENSOR_1_MOTION
+  #endif
 #elif defined(SENSOR_1_SOFTWARE_SPI)
   , SENSOR_1_SOFTWARE_SPI
 #endif
 );
 
 #if defined(PIN_SENSOR_2_SELECT)
-  adns s2(PIN_SENSOR_2_SELECT, reported_cpi
+  trackball_sensor s2(PIN_SENSOR_2_SELECT, reported_cpi
   #if defined(SENSOR_2_SPI_DEVICE)
     , SENSOR_2_SPI_DEVICE
+    #if defined(PIN_SENSOR_2_MOTION)
+      , PIN_SENSOR_2_MOTION
+    #endif
   #elif defined(SENSOR_2_SOFTWARE_SPI)
     , SENSOR_2_SOFTWARE_SPI
   #endif
@@ -315,9 +582,131 @@ adns s1(PIN_SENSOR_1_SELECT, reported_cpi
 #endif
 
 // scrolling
-const int scroll_tick = 64;
-float scroll_accum = 0;
+// Counts of Z per scroll detent.
+// This used to be 64, when Z was the average of the sensors' Y readings. With the sensors 30 degrees below the equator,
+// those only see cos(30) of the twist, and the geometric transform reports all of it, so the same twist now comes out
+// about 15% bigger. 74 (64 / cos(30), rounded) keeps scrolling at the speed it was.
+const int scroll_tick = 74;
+scroll_engine scroller(scroll_tick, scroll_resolution, report_Hz,
+#if defined(SCROLL_MOMENTUM)
+  true
+#else
+  false
+#endif
+);
+// Decides whether motion is scrolling or pointer motion. Its settings can be adjusted at runtime.
+motion_classifier classifier;
+
+#if DYNAMIC_CPI
+// Picks the sensor CPI from recent speed. This runs wherever the sensors are read (core1, with DUAL_CORE).
+dynamic_cpi cpi_control;
+#endif
+
+#if defined(POINTER_ACCELERATION)
+// Speeds are in counts/ms, at reported_cpi.
+const acceleration_curve::point_t acceleration_points[] = 
+{
+  { 0.5, 0.5 },   // slow it down a bit for fine positioning
+  { 2,   1   },
+  { 10,  2   },
+  { 24,  3   }
+};
+struct acceleration_preset
+{
+  const char *name;
+  acceleration_curve::settings_t settings;
+};
+const acceleration_preset acceleration_presets[] = 
+{
+  //                          curve                         gain  cap  speed shape
+  { "none",                 { acceleration_curve::linear,   1,    1,   0,    0,    NULL, 0 } },
+  { "power",                { acceleration_curve::power,    1,    4,   8,    1.5,  NULL, 0 } },
+  { "sigmoid",              { acceleration_curve::sigmoid,  1,    3,   6,    1.5,  NULL, 0 } },
+  { "points",               { acceleration_curve::points,   0,    0,   0,    0,    acceleration_points, 
+                                                                    sizeof(acceleration_points) / sizeof(acceleration_points[0]) } },
+};
+const int acceleration_preset_count = sizeof(acceleration_presets) / sizeof(acceleration_presets[0]);
+int acceleration_preset_index = ACCELERATION_PRESET;
+acceleration_curve pointer_acceleration;
+
+void set_acceleration_preset(int index)
+{
+  acceleration_preset_index = index % acceleration_preset_count;
+  pointer_acceleration.set_curve(acceleration_presets[acceleration_preset_index].settings);
+  debugLogger.printf("Pointer acceleration: %s\n", acceleration_presets[acceleration_preset_index].name);
+}
+#endif
 
+#if TRANSFORM_CALIBRATION
+// While this is running, read_sensors() feeds it the raw sensor readings, and no motion goes to the host.
+transform_calibration calibration;
+// True when st is a calibrated transform rather than st_geometry.
+// st_s1 and st_s2 come from the geometry model, so fuse_sensors() doesn't fall back on them then.
+bool transform_calibrated = false;
+
+// A calibrated transform, as it's saved in flash.
+struct saved_transform
+{
+  uint32_t magic;
+  // The transform is only good for the build it was made with.
+  float handedness;
+  float st[3][4];
+};
+const uint32_t saved_transform_magic = 0x53544341;   // "STCA"
+
+#if defined(ARDUINO_ARCH_SAMD)
+  // The SAMD21 has no EEPROM, so this reserves some of the program flash.
+  FlashStorage(transform_storage, saved_transform);
+#endif
+
+void load_transform();
+#endif
+
+// Range of the x/y deltas in a report.
+#if USE_CUSTOM_HID_DESCRIPTOR
+  const int report_delta_min = SHRT_MIN;
+  const int report_delta_max = SHRT_MAX;
+#else
+  const int report_delta_min = SCHAR_MIN;
+  const int report_delta_max = SCHAR_MAX;
+#endif
+
+// Everything which hasn't been reported yet.
+// Only whole counts go into a report, and a report can only hold so much, so whatever's left over
+// (fractions of a count, or the part of a fast movement that didn't fit) carries over into the next one.
+// The same goes for anything that couldn't be sent because the host hadn't taken the last report yet.
+report_coalescer<motion_t> pending_report(report_delta_min, report_delta_max);
+
+#define CLAMP(val, min, max) (val > max)?max:((val < min)?min:val)
+
+#if defined(DUAL_CORE)
+  #if !defined(ARDUINO_ARCH_RP2040)
+    #error DUAL_CORE is only supported on rp2040
+  #endif
+
+  // Transformed sensor motion, passed from core1 to core0.
+  struct motion_sample
+  {
+    unsigned long time;   // micros() when the motion was read
+    MotionVector delta;
+  };
+  ring_buffer<motion_sample, 32> motion_samples;
+
+  // Set at the end of setup(), so core1 doesn't touch the sensors until the pins and USB are ready.
+  volatile bool core0_ready = false;
+
+  // Core0 sets core1_pause_request when it needs to use the sensors itself, 
+  // and core1 sets core1_paused once it has stopped.
+  volatile bool core1_pause_request = false;
+  volatile bool core1_paused = false;
+  void pause_core1();
+  void resume_core1();
+
+  #if defined(LOG_REPORT_LATENCY)
+    // Longest time a sample has waited in motion_samples, since the last time it was logged.
+    unsigned long sample_age_max = 0;
+  #endif
+#endif
 
 #if SENSOR_DISPLAY == 1
   Adafruit_SSD1327 display(128, 128, &DISPLAY_WIRE_DEVICE, -1, 2000000UL);
@@ -491,7 +880,12 @@ void display_sensors()
   unsigned long read1 = micros();
   unsigned long render1 = read1;
 
-  if (width1 != 0)
+  // Setting up capture mode goes through the init steps. Until it's done, there's nothing to read.
+  // (Core1 is paused while the display is up, so this has to step them here.)
+  s1.init_step();
+  s2.init_step();
+
+  if ((width1 != 0) && s1.capturing())
   {
     // Sensor 1 is present
     s1.read_image(pixels);
@@ -512,7 +906,7 @@ void display_sensors()
   unsigned long read2 = micros();
   unsigned long render2 = read2;
 
-  if (width2 != 0)
+  if ((width2 != 0) && s2.capturing())
   {
     s2.read_image(pixels);
     render2 = micros();
@@ -552,6 +946,9 @@ void set_sensor_display(bool enable)
   if (!sensor_display_mode && enable) {
     sensor_display_mode = true;
     reset_display();
+#if defined(DUAL_CORE)
+    pause_core1();
+#endif
     s1.begin_image_capture();
     s2.begin_image_capture();
   } else if (sensor_display_mode && !enable) {
@@ -559,6 +956,9 @@ void set_sensor_display(bool enable)
     reset_display();
     s1.end_image_capture();
     s2.end_image_capture();
+#if defined(DUAL_CORE)
+    resume_core1();
+#endif
   }
 
 }
@@ -568,6 +968,9 @@ void disable_sensor_display()
   sensor_display_mode = false;
   s1.end_image_capture();
   s2.end_image_capture();
+#if defined(DUAL_CORE)
+  resume_core1();
+#endif
 }
 #endif
 
@@ -686,16 +1089,23 @@ void setup()
   // TinyUSB Setup
   USBDevice.setProductDescriptor(deviceName);
   usb_hid.setStringDescriptor(deviceName);
-  usb_hid.setPollInterval(2);
+  usb_hid.setPollInterval(scheduler.poll_interval());
   usb_hid.setReportDescriptor(desc_hid_report, sizeof(desc_hid_report));
+  usb_hid.setBootProtocol(HID_ITF_PROTOCOL_MOUSE);
+#if USE_CUSTOM_HID_DESCRIPTOR
+  usb_hid.setReportCallback(hid_get_report, hid_set_report);
+#endif
 
   usb_hid.begin();
 
   // wait until device mounted
   while( !USBDevice.mounted() ) delay(1);
 
-#if defined(SERIAL_DEBUG)
+#if defined(SERIAL_DEBUG) || defined(STAGE_HISTOGRAMS)
   Serial.begin(115200);
+#endif
+
+#if defined(SERIAL_DEBUG)
 
 #if 1
   // Wait for the serial port to be opened.
@@ -739,32 +1149,24 @@ void setup()
 //   }
 // #endif
 
-  debugLogger.printf("Initializing sensor 1:\n");
-  bool s1_inited = s1.init();
-
-  debugLogger.printf("Initializing sensor 2:\n");
-  bool s2_inited = s2.init();
-
-  // Since converting to Adafruit_SPIDevice, sometimes the first init attempt fails, 
-  // for reasons I haven't yet figured out.
-  // Retrying after initing the other sensor sometimes seems to work, which makes no sense.
-  if (!s1_inited)
-  {
-    debugLogger.printf("Sensor 1 init failed, trying again:\n");
-    s1.init();
-  }
+  // Start bringing up the sensors. 
+  // loop() advances both of them together, so their reset and firmware upload waits overlap, 
+  // and the buttons work while that's happening.
+#if !defined(DUAL_CORE)
+  debugLogger.printf("Initializing sensors\n");
+  s1.begin_init();
+  s2.begin_init();
+#endif
 
-  if (!s2_inited)
-  {
-    debugLogger.printf("Sensor 2 init failed, trying again:\n");
-    s2.init();
-  }
+  button_input.begin();
 
+#if TRANSFORM_CALIBRATION
+  load_transform();
+#endif
 
-  for(int i=0; i<buttonCount; i++)
-  {
-      pinMode(buttonPins[i], INPUT_PULLUP);
-  }
+#if defined(POINTER_ACCELERATION)
+  set_acceleration_preset(ACCELERATION_PRESET);
+#endif
 
 #if defined(SENSOR_DISPLAY_I2C)
   if (!i2c_probe_bus())
@@ -820,6 +1222,11 @@ void setup()
 
   debugLogger.printf("Initialization complete.\n");
 
+#if defined(DUAL_CORE)
+  // Let core1 start on the sensors.
+  core0_ready = true;
+#endif
+
 #if defined(SENSOR_DISPLAY) && defined(SENSOR_DISPLAY_ON_STARTUP)
   set_sensor_display(true);
 #endif
@@ -856,270 +1263,931 @@ void printBurst(adns &sensor)
     debugLogger.printf("x/y = %d/%d", sensor.x, sensor.y);
     debugLogger.println("");
 }
-void loop() 
-{
-  unsigned long loop_start_time = micros();
-  // Time taken by the last loop, saved so we can display it during the next loop.
-  static unsigned long loop_time = 0;
-  bool sendReport = false;
-  bool sendWakeup = false;
-  Vector delta;
-  int scroll = 0;
 
-#if SENSOR_DISPLAY
-  if(sensor_display_mode)
+// Number of times to retry a sensor that fails to initialize.
+// Since converting to Adafruit_SPIDevice, sometimes the first init attempt fails, 
+// for reasons I haven't yet figured out.
+// Retrying after initing the other sensor sometimes seems to work, which makes no sense.
+const int sensor_init_retries = 1;
+
+// Advance sensor initialization, retrying if it fails.
+void init_sensor_step(adns &sensor, int &retries, int number)
+{
+  if (sensor.init_step() && sensor.failed() && retries > 0)
   {
-    display_sensors();
+    retries--;
+    debugLogger.printf("Sensor %d init failed, trying again:\n", number);
+    sensor.begin_init();
   }
-  else
+}
+
+#if TRANSFORM_CALIBRATION
+// Saves a transform to flash. If valid is false, this forgets any saved one instead.
+void save_transform(const float transform[3][4], bool valid)
+{
+  saved_transform saved;
+  saved.magic = valid?saved_transform_magic:0;
+  saved.handedness = handedness;
+  memcpy(saved.st, transform, sizeof(saved.st));
+#if defined(ARDUINO_ARCH_RP2040)
+  EEPROM.put(0, saved);
+  EEPROM.commit();
+#else
+  transform_storage.write(saved);
 #endif
+}
+
+// Replaces st with the saved transform, if there is one.
+void load_transform()
+{
+  saved_transform saved;
+#if defined(ARDUINO_ARCH_RP2040)
+  // This is the smallest size the EEPROM emulation allows.
+  static_assert(sizeof(saved_transform) <= 256, "saved_transform doesn't fit");
+  EEPROM.begin(256);
+  EEPROM.get(0, saved);
+#else
+  saved = transform_storage.read();
+#endif
+  if (saved.magic != saved_transform_magic || saved.handedness != handedness)
+  {
+    debugLogger.printf("Using the built-in sensor transform\n");
+    return;
+  }
+  for (int i = 0; i < 3; i++)
   {
-    // Poll sensors for mouse movement
+    for (int j = 0; j < 4; j++)
+    {
+      st[i][j] = motion_t(saved.st[i][j]);
+    }
+  }
+  transform_calibrated = true;
+  debugLogger.printf("Using the calibrated sensor transform\n");
+}
 
-    // v1 and v2 contain the floating point x/y motion values from each sensor, 
-    // scaled from the sensor's CPI to units of reported_cpi.
-    Vector v1 = s1.motion();
-    Vector v2 = s2.motion();
+void print_calibration_step()
+{
+  switch (calibration.phase)
+  {
+    case transform_calibration::roll_x: debugLogger.printf("Calibration: roll the ball left and right, then click left\n"); break;
+    case transform_calibration::roll_y: debugLogger.printf("Calibration: roll the ball up and down, then click left\n"); break;
+    case transform_calibration::twist: debugLogger.printf("Calibration: twist the ball back and forth, then click left\n"); break;
+    default: break;
+  }
+}
 
-#if 0
-    // Print all values from the burst.
-    // Possibly useful for tweaking sensor parameters.
-    debugLogger.printf("s1: ");
-    printBurst(s1);
-    debugLogger.printf("s2: ");
-    printBurst(s2);
+// Sets st, with core1 paused so it can't see a half-written transform.
+// calibrated says whether it came from calibration or st_geometry.
+void set_transform(const float transform[3][4], bool calibrated)
+{
+#if defined(DUAL_CORE)
+  pause_core1();
+#endif
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 4; j++)
+    {
+      st[i][j] = motion_t(transform[i][j]);
+    }
+  }
+  transform_calibrated = calibrated;
+#if defined(DUAL_CORE)
+  resume_core1();
 #endif
+}
 
-#if 0
-    // Useful when debugging sensor scaling
-    debugLogger.print(F("report_cpi = "));
-    debugLogger.print(s1.report_cpi);
-    debugLogger.print(F(", current_cpi = "));
-    debugLogger.print(s1.current_cpi);
-    debugLogger.print(F(", cpi_scale_factor = "));
-    debugLogger.print(s1.cpi_scale_factor);
-    debugLogger.print(F(", x = "));
-    debugLogger.print(s1.x);
-    debugLogger.print(F(", y = "));
-    debugLogger.print(s1.y);
-    debugLogger.print(F(", v = "));
-    debugLogger.print(v1);
-    debugLogger.println("");
+void start_calibration()
+{
+  // Let go of the buttons in the chord. Nothing else goes to the host until calibration is done.
+  buttons = 0;
+  pending_report.set_buttons(buttons);
+  scroller.cancel();
+
+#if defined(DUAL_CORE)
+  // Core1 adds the samples, so it can't be in the middle of one while the sums are cleared.
+  pause_core1();
 #endif
+  calibration.start();
+#if defined(DUAL_CORE)
+  resume_core1();
+#endif
+  click();
+  print_calibration_step();
+}
 
-    // Given the way my design mounts the sensors (with the wire attachment at the top), the 9800 is inverted relative to the others.
-    if (s1.sensor_type() == adns::PID_adns9800)
+void finish_calibration()
+{
+  float current[3][4];
+  float result[3][4];
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 4; j++)
     {
-      v1 = -v1;
+      current[i][j] = float(st[i][j]);
     }
-    if (s2.sensor_type() == adns::PID_adns9800)
+  }
+#if defined(DUAL_CORE)
+  // Core1 checks the phase before adding a sample, so it could still be finishing one that started before the last click.
+  pause_core1();
+#endif
+  bool solved = calibration.solve(current, result);
+#if defined(DUAL_CORE)
+  resume_core1();
+#endif
+  if (!solved)
+  {
+    debugLogger.printf("Calibration failed (%lu, %lu, %lu samples), keeping the old transform\n", 
+      (unsigned long)calibration.samples[0], (unsigned long)calibration.samples[1], (unsigned long)calibration.samples[2]);
+    return;
+  }
+
+  set_transform(result, true);
+  save_transform(result, true);
+  click();
+  debugLogger.printf("Calibration done, new transform:\n");
+  for (int i = 0; i < 3; i++)
+  {
+    debugLogger.printf("  { %d, %d, %d, %d } / 1000\n", 
+      int(result[i][0] * 1000), int(result[i][1] * 1000), int(result[i][2] * 1000), int(result[i][3] * 1000));
+  }
+}
+
+// Watches for the button chord that starts calibration, and handles the buttons while it's running.
+// Returns true if calibration has the buttons, in which case nothing should go to the host.
+bool calibration_buttons(bool changed)
+{
+  static char previous = 0;
+  char state = button_input.state;
+  char pressed = state & ~previous;
+  previous = state;
+
+  if (calibration.phase == transform_calibration::idle)
+  {
+    static bool chord_held = false;
+    static unsigned long chord_start = 0;
+    if (state != (MOUSE_BUTTON_LEFT | MOUSE_BUTTON_RIGHT))
+    {
+      chord_held = false;
+      return false;
+    }
+    if (!chord_held)
     {
-      v2 = -v2;
+      chord_held = true;
+      chord_start = millis();
     }
+#if SENSOR_DISPLAY
+    // Sensor display mode has the sensors to itself.
+    if (sensor_display_mode)
+    {
+      return false;
+    }
+#endif
+    if (millis() - chord_start < CALIBRATION_CHORD_MILLIS)
+    {
+      // Hold this change back while the chord might still turn into calibration, so the host never sees
+      // left and right down together (X11's middle button emulation, for one, would turn it into a middle click).
+      // Whatever the buttons do next goes out as usual.
+      return changed;
+    }
+    chord_held = false;
+    start_calibration();
+    return true;
+  }
 
-    if (v1.x != 0 || v1.y != 0 || v2.x != 0 || v2.y != 0)
+  if (pressed & MOUSE_BUTTON_RIGHT)
+  {
+    calibration.cancel();
+    debugLogger.printf("Calibration cancelled\n");
+  }
+  else if (pressed & MOUSE_BUTTON_MIDDLE)
+  {
+    calibration.cancel();
+    float geometry[3][4];
+    for (int i = 0; i < 3; i++)
     {
-      // The sensor reported movement.
-
-      // multiply the sensor transform matrix by the vector of [v1.x, v1.y, v2.x, v2.y]
-      delta = Vector(
-        st[0][0] * v1.x + st[0][1] * v1.y + st[0][2] * v2.x + st[0][3] * v2.y, 
-        st[1][0] * v1.x + st[1][1] * v1.y + st[1][2] * v2.x + st[1][3] * v2.y, 
-        st[2][0] * v1.x + st[2][1] * v1.y + st[2][2] * v2.x + st[2][3] * v2.y
-      );
-
-      ////// This is probably only useful when actively debugging sensor readings or the transform matrix.
-      ////// Otherwise it gets very spammy.
-      // debugLogger.print(F("v1 = "));
-      // debugLogger.print(v1);
-      // debugLogger.print(F(", v2 = "));
-      // debugLogger.print(v2);
-      // debugLogger.print(F(", delta = "));
-      // debugLogger.print(delta);
-      // debugLogger.println("");
-
-      // Figure out if we should scroll
-      if ((fabs(delta.z) > (fabs(delta.x) * 2)) && (fabs(delta.z) > (fabs(delta.y) * 2)))
-      {
-        // Looks like we're scrolling more than not.
-        scroll_accum += delta.z;
-        scroll = scroll_accum / scroll_tick;
-        scroll_accum -= scroll * scroll_tick;
-
-        // When we're scrolling, disable x/y movement
-        delta.x = 0;
-        delta.y = 0;
-        // debugLogger.print("Calculated scroll = ");
-        // debugLogger.print(scroll);
-        // debugLogger.print(", scroll_accum =  ");
-        // debugLogger.println(scroll_accum);
-      }
-      else
+      for (int j = 0; j < 4; j++)
       {
-        delta.z = 0;
+        geometry[i][j] = float(st_geometry[i][j]);
       }
+    }
+    set_transform(geometry, false);
+    save_transform(geometry, false);
+    click();
+    debugLogger.printf("Calibration cleared, using the built-in sensor transform\n");
+  }
+  else if (pressed & MOUSE_BUTTON_LEFT)
+  {
+    calibration.next();
+    if (calibration.phase == transform_calibration::idle)
+    {
+      finish_calibration();
+    }
+    else
+    {
+      click();
+      print_calibration_step();
+    }
+  }
 
-      if (scroll != 0)
-      {
-          click();
-      }
-      if ((delta.x != 0) || (delta.y != 0) || 
-#if USE_SCROLL_RESOLUTION_MULTIPLIER
-        (delta.z != 0)
-#else
-        (scroll != 0)
+  // This change (including the one that ended calibration) doesn't go to the host.
+  return changed;
+}
+#endif
+
+// Picks up any button changes since the last call.
+// Returns true if any button changed state.
+bool poll_buttons()
+{
+  // Hold off on the next change until the last one has gone out, so the host sees every press and release.
+  // The edges wait in button_input's queue (with their timestamps) in the meantime.
+  bool changed = !pending_report.buttons_changed && button_input.update();
+#if TRANSFORM_CALIBRATION
+  if (calibration_buttons(changed))
+  {
+    // Calibration has the buttons.
+    return false;
+  }
 #endif
-      )
+  if (changed)
+  {
+#if FUNCTION_BUTTON_ACTION == 3 && defined(POINTER_ACCELERATION)
+    if ((button_input.state & button_function) && !(buttons & button_function))
+    {
+      set_acceleration_preset(acceleration_preset_index + 1);
+      click();
+    }
+#endif
+    buttons = button_input.state;
+    pending_report.set_buttons(buttons);
+    scroller.cancel();
+  }
+#if defined(BUTTON_LIGHTS)
+  // For the first three buttons, set a color whenever the button is down
+  for(int i=0; i<buttonCount; i++)
+  {
+    if (buttons & buttonNames[i])
+    {
+      switch(i)
       {
-        sendReport = true;
+        case 0: ledRed = 1.0; break;
+        case 1: ledGreen = 1.0; break;
+        case 2: ledBlue = 1.0; break;
+        default: break;
       }
     }
   }
-  
-  // Poll for button states 
-  if(1)
+#endif
+#if SENSOR_DISPLAY
+  // Only if the display was found on startup...
+  if (display_ready)
   {
-    for(int i=0; i<buttonCount; i++)
+    // Check for the toggle condition
+    static char prevButtons = 0;
+#if FUNCTION_BUTTON_ACTION == 2
+    if ((buttons & button_function) && !(prevButtons & button_function))
     {
-      int name = buttonNames[i];
-      if (digitalRead(buttonPins[i]) == LOW)
-      {
-#if defined(BUTTON_LIGHTS)
-        // For the first three buttons, set a color whenever the button is down
-        switch(i)
-        {
-          case 0: ledRed = 1.0; break;
-          case 1: ledGreen = 1.0; break;
-          case 2: ledBlue = 1.0; break;
-          default: break;
-        }
+      set_sensor_display(!sensor_display_mode);
+    }
+    else
 #endif
-        if (!(buttons & name))
-        {
-          // debugLogger.print(F("pressing mouse button "));
-          // debugLogger.println(name);
-          buttons |= name;
-          sendReport = true;
-          sendWakeup = true;
-        }
-      }
-      else
-      {
-        if (buttons & name)
+    if (prevButtons == 0x07 && buttons != 0x07)
+    {
+      // All 3 buttons were pressed
+      set_sensor_display(!sensor_display_mode);
+    }
+    else if (sensor_display_mode)
+    {
+        // If we're in sensor display mode, the main button toggles zoom focus
+        if (prevButtons == 0x01 && buttons == 0x00)
         {
-          // debugLogger.print(F("releasing mouse button "));
-          // debugLogger.println(name);
-          buttons &= ~name;
-          sendReport = true;
-          sendWakeup = true;
+          sensor_display_zoom_select = !sensor_display_zoom_select;
+          // Erase the sensor draw area
+          const int max_sensor_draw_size = ((36 * 2) + 2);
+          display.fillRect(
+            0, 
+            display.height() - max_sensor_draw_size,
+            display.width(),
+            max_sensor_draw_size,
+            text_bg);
         }
-      }
     }
-#if SENSOR_DISPLAY
-    // Only if the display was found on startup...
-    if (display_ready)
+    prevButtons = buttons;
+  }
+#endif
+
+  return changed;
+}
+
+#if SENSOR_FUSION
+// Returns how much to trust a sensor's last reading, from 0 to 256.
+int sensor_weight(adns &sensor)
+{
+  if (sensor.lifted() || sensor.Shutter > fusion_shutter_max || sensor.SQUAL <= fusion_squal_min)
+  {
+    return 0;
+  }
+  if (sensor.SQUAL >= fusion_squal_good)
+  {
+    return 256;
+  }
+  return ((sensor.SQUAL - fusion_squal_min) * 256) / (fusion_squal_good - fusion_squal_min);
+}
+
+// Takes the output of the full transform, and if one sensor is less trustworthy than the other,
+// fades from that toward X/Y from the better sensor alone.
+// This is nearly free when both sensors are fine, which is most of the time.
+MotionVector fuse_sensors(const MotionVector &full, const MotionVector &v1, const MotionVector &v2)
+{
+  if (!s1.initialized() || !s2.initialized())
+  {
+    return full;
+  }
+#if TRANSFORM_CALIBRATION
+  if (transform_calibrated)
+  {
+    // The single-sensor transforms don't match a calibrated st, so fading toward them would change the gain
+    // and crosstalk whenever one sensor's weight dropped. A calibrated transform only describes both sensors
+    // together, so there's no good single-sensor version to work out from it.
+    return full;
+  }
+#endif
+  int w1 = sensor_weight(s1);
+  int w2 = sensor_weight(s2);
+  if (w1 == w2)
+  {
+    // Either both are fine, or both are in the same trouble, so there's nothing better to do.
+    return full;
+  }
+
+  MotionVector single;
+  int weak, strong;
+  if (w1 > w2)
+  {
+    single = MotionVector(
+      st_s1[0][0] * v1.x + st_s1[0][1] * v1.y,
+      st_s1[1][0] * v1.x + st_s1[1][1] * v1.y,
+      st_s1[2][0] * v1.x + st_s1[2][1] * v1.y
+    );
+    weak = w2;
+    strong = w1;
+  }
+  else
+  {
+    single = MotionVector(
+      st_s2[0][0] * v2.x + st_s2[0][1] * v2.y,
+      st_s2[1][0] * v2.x + st_s2[1][1] * v2.y,
+      st_s2[2][0] * v2.x + st_s2[2][1] * v2.y
+    );
+    weak = w1;
+    strong = w2;
+  }
+
+  // How much of the full transform to keep.
+  motion_t keep = motion_t((weak * 256) / strong) / 256;
+  return (full * keep) + (single * (motion_t(1) - keep));
+}
+#endif
+
+#if DYNAMIC_CPI
+// Puts a sensor at the CPI cpi_control wants.
+// set_cpi() only queues the register writes, so this doesn't hold anything up.
+// If the queue has no room, or an earlier change is still going out, the next call tries again.
+// This is a template so that with SENSOR_MODEL set, it gets adns_fixed's set_cpi().
+template <class Sensor>
+void update_sensor_cpi(Sensor &sensor)
+{
+  int max_cpi = sensor.max_cpi();
+  if (!sensor.initialized() || max_cpi == 0)
+  {
+    return;
+  }
+  int cpi = max_cpi;
+  if (cpi_control.fast && DYNAMIC_CPI_LOW < max_cpi)
+  {
+    cpi = DYNAMIC_CPI_LOW;
+  }
+  if (cpi != sensor.current_cpi && !sensor.cpi_changing())
+  {
+    sensor.set_cpi(cpi);
+  }
+}
+#endif
+
+// Reads motion from both sensors and runs it through the sensor transform.
+// Returns (0, 0, 0) if neither sensor moved.
+// s1.begin_motion() should already have been called, so its burst can overlap with other work.
+MotionVector read_sensors()
+{
+  MotionVector delta;
+  STAGE_BEGIN(sensor_mark);
+
+  // v1 and v2 contain the x/y motion values from each sensor (as motion_t), 
+  // scaled from the sensor's CPI to units of reported_cpi.
+  // Both sensors share the SPI bus, so their bursts have to be read one after the other.
+  // Sensor 1's burst was started earlier, so its stage is only the part that didn't overlap with anything else.
+  MotionVector v1(s1.end_motion());
+  STAGE_END(stage_burst_1, sensor_mark);
+  s2.begin_motion();
+  MotionVector v2(s2.end_motion());
+  STAGE_END(stage_burst_2, sensor_mark);
+
+#if 0
+  // Print all values from the burst.
+  // Possibly useful for tweaking sensor parameters.
+  debugLogger.printf("s1: ");
+  printBurst(s1);
+  debugLogger.printf("s2: ");
+  printBurst(s2);
+#endif
+
+#if 0
+  // Useful when debugging sensor scaling
+  debugLogger.print(F("report_cpi = "));
+  debugLogger.print(s1.report_cpi);
+  debugLogger.print(F(", current_cpi = "));
+  debugLogger.print(s1.current_cpi);
+  debugLogger.print(F(", cpi_scale_q16 = "));
+  debugLogger.print(s1.cpi_scale_q16);
+  debugLogger.print(F(", x = "));
+  debugLogger.print(s1.x);
+  debugLogger.print(F(", y = "));
+  debugLogger.print(s1.y);
+  debugLogger.print(F(", v = "));
+  debugLogger.print(v1);
+  debugLogger.println("");
+#endif
+
+#if DYNAMIC_CPI
+  // Go by whichever sensor saw more motion. This is called even when nothing moved, so it notices the ball stopping.
+  {
+    fixed16 x1(v1.x), y1(v1.y), x2(v2.x), y2(v2.y);
+    bool use_v1 = (vector_abs(x1) + vector_abs(y1)) > (vector_abs(x2) + vector_abs(y2));
+    cpi_control.update(use_v1?x1.raw:x2.raw, use_v1?y1.raw:y2.raw, micros());
+    update_sensor_cpi(s1);
+    update_sensor_cpi(s2);
+  }
+#endif
+
+  // Given the way my design mounts the sensors (with the wire attachment at the top), the 9800 is inverted relative to the others.
+  if (s1.sensor_type() == adns::PID_adns9800)
+  {
+    v1 = -v1;
+  }
+  if (s2.sensor_type() == adns::PID_adns9800)
+  {
+    v2 = -v2;
+  }
+
+  if (v1.x != 0 || v1.y != 0 || v2.x != 0 || v2.y != 0)
+  {
+    // The sensor reported movement.
+#if defined(LOG_MOTION_TRACE)
+    debugLogger.printf("trace %lu %ld %ld %ld %ld\n", micros(), 
+      long(fixed16(v1.x).raw), long(fixed16(v1.y).raw), long(fixed16(v2.x).raw), long(fixed16(v2.y).raw));
+#endif
+
+#if TRANSFORM_CALIBRATION
+    calibration.add(fixed16(v1.x).raw >> 8, fixed16(v1.y).raw >> 8, fixed16(v2.x).raw >> 8, fixed16(v2.y).raw >> 8);
+#endif
+
+    // multiply the sensor transform matrix by the vector of [v1.x, v1.y, v2.x, v2.y]
+    delta = MotionVector(
+      st[0][0] * v1.x + st[0][1] * v1.y + st[0][2] * v2.x + st[0][3] * v2.y, 
+      st[1][0] * v1.x + st[1][1] * v1.y + st[1][2] * v2.x + st[1][3] * v2.y, 
+      st[2][0] * v1.x + st[2][1] * v1.y + st[2][2] * v2.x + st[2][3] * v2.y
+    );
+#if SENSOR_FUSION
+    delta = fuse_sensors(delta, v1, v2);
+#endif
+
+    ////// This is probably only useful when actively debugging sensor readings or the transform matrix.
+    ////// Otherwise it gets very spammy.
+    // debugLogger.print(F("v1 = "));
+    // debugLogger.print(v1);
+    // debugLogger.print(F(", v2 = "));
+    // debugLogger.print(v2);
+    // debugLogger.print(F(", delta = "));
+    // debugLogger.print(delta);
+    // debugLogger.println("");
+  }
+  STAGE_END(stage_transform, sensor_mark);
+
+  return delta;
+}
+
+// Decides whether a transformed sensor movement (from a sample taken at the given micros() time) is scrolling or pointer motion, 
+// and adds it to the report being built (delta for motion, or the scroll engine for scrolling).
+void apply_motion(MotionVector motion, unsigned long time, MotionVector &delta)
+{
+  if (motion.x == 0 && motion.y == 0 && motion.z == 0)
+  {
+    return;
+  }
+#if TRANSFORM_CALIBRATION
+  if (calibration.phase != transform_calibration::idle)
+  {
+    // The ball is being rolled around for calibration, which shouldn't move the pointer.
+    return;
+  }
+#endif
+
+  // Figure out if we should scroll
+  if (classifier.classify(fixed16(motion.x).raw, fixed16(motion.y).raw, fixed16(motion.z).raw, time) == motion_classifier::scroll)
+  {
+    // Looks like we're scrolling more than not.
+    scroller.add(fixed16(motion.z).raw);
+
+    // When we're scrolling, disable x/y movement
+    motion.x = 0;
+    motion.y = 0;
+  }
+  else
+  {
+    // Moving the ball some other way stops any momentum scrolling.
+    scroller.cancel();
+    motion.z = 0;
+  }
+  delta += motion;
+}
+
+#if defined(DUAL_CORE)
+// Core1 reads the sensors as fast as they'll go and runs the transform.
+// Everything else (buttons, the display, LEDs, and USB) stays on core0, so none of it can hold up a sensor read.
+// The sensors belong to core1 while this is running. Core0 only touches them when core1 is paused (for sensor display mode).
+
+void setup1()
+{
+  // Wait for setup() to get USB and the pins ready.
+  while (!core0_ready)
+  {
+    delay(1);
+  }
+
+  // Start bringing up the sensors. loop1() advances both of them together.
+  debugLogger.printf("Initializing sensors on core1\n");
+  s1.begin_init();
+  s2.begin_init();
+}
+
+void loop1()
+{
+  if (core1_pause_request)
+  {
+    core1_paused = true;
+    return;
+  }
+  core1_paused = false;
+
+  static int s1_retries = sensor_init_retries;
+  static int s2_retries = sensor_init_retries;
+  init_sensor_step(s1, s1_retries, 1);
+  init_sensor_step(s2, s2_retries, 2);
+  s1.service();
+  s2.service();
+
+  // Motion that didn't fit in the queue. It's merged with the next sample instead of being dropped.
+  static motion_sample pending;
+  static bool have_pending = false;
+
+  s1.begin_motion();
+  MotionVector motion = read_sensors();
+  if (motion.x != 0 || motion.y != 0 || motion.z != 0)
+  {
+    if (!have_pending)
     {
-      // Check for the toggle condition
-      static char prevButtons = 0;
-      if (prevButtons == 0x07 && buttons != 0x07)
-      {
-        // All 3 buttons were pressed
-        set_sensor_display(!sensor_display_mode);
-      }
-      else if (sensor_display_mode)
-      {
-          // If we're in sensor display mode, the main button toggles zoom focus
-          if (prevButtons == 0x01 && buttons == 0x00)
-          {
-            sensor_display_zoom_select = !sensor_display_zoom_select;
-            // Erase the sensor draw area
-            const int max_sensor_draw_size = ((36 * 2) + 2);
-            display.fillRect(
-              0, 
-              display.height() - max_sensor_draw_size,
-              display.width(),
-              max_sensor_draw_size,
-              text_bg);
-          }
-      }
-      prevButtons = buttons;
+      pending.time = micros();
+      pending.delta = motion;
+      have_pending = true;
     }
-#endif
+    else
+    {
+      pending.delta += motion;
+    }
+  }
 
+  if (have_pending && motion_samples.push(pending))
+  {
+    have_pending = false;
   }
-  if (sendWakeup && USBDevice.suspended())
+}
+
+void pause_core1()
+{
+  core1_pause_request = true;
+  while (!core1_paused)
   {
-    USBDevice.remoteWakeup();
+    yield();
   }
-  if (sendReport)
+}
+
+void resume_core1()
+{
+  core1_pause_request = false;
+  // Wait for core1 to notice, so a quick pause_core1() after this can't see the old acknowledgement.
+  while (core1_paused)
   {
-    #define CLAMP(val, min, max) (val > max)?max:((val < min)?min:val)
-#if !USE_CUSTOM_HID_DESCRIPTOR
-      // if (scroll != 0)
-      // {
-      //   debugLogger.print("reporting wheel = ");
-      //   debugLogger.println(scroll);
-      // }
-      usb_hid.mouseReport(
-        0, 
-        buttons, 
-        CLAMP(delta.x, SCHAR_MIN, SCHAR_MAX),
-        CLAMP(delta.y, SCHAR_MIN, SCHAR_MAX),
-        CLAMP(scroll, SCHAR_MIN, SCHAR_MAX),
-        0);
-#else
-#if USE_16_BIT_DELTAS
-    typedef int16_t delta_t;
-    const int delta_min = SHRT_MIN;
-    const int delta_max = SHRT_MAX;
-#else
-    typedef int8_t delta_t;
-    const int delta_min = SCHAR_MIN;
-    const int delta_max = SCHAR_MAX;
+    yield();
+  }
+}
 #endif
 
-    // With the resolution multiplier, we have deviated from the standard mouse report.
-    // Roll our own here.
+// Sends as much of pending_report as will fit in a report.
+// Returns false if the host hasn't taken the last report yet. In that case, everything stays pending.
+bool send_report()
+{
+  if (!tud_hid_ready())
+  {
+    pending_report.report_merged();
+    return false;
+  }
+
+  int report_x = pending_report.report_x();
+  int report_y = pending_report.report_y();
+  int wheel = pending_report.report_wheel();
+  int pan = pending_report.report_pan();
+
+  bool queued;
+#if !USE_CUSTOM_HID_DESCRIPTOR
+  // if (wheel != 0)
+  // {
+  //   debugLogger.print("reporting wheel = ");
+  //   debugLogger.println(wheel);
+  // }
+  queued = usb_hid.mouseReport(
+    0, 
+    buttons & ~button_function, 
+    report_x,
+    report_y,
+    wheel,
+    pan);
+#else
+  if (usb_hid.getProtocol() == HID_PROTOCOL_BOOT)
+  {
+    // The host (probably a BIOS) asked for the boot protocol, which only has the buttons and 8 bit X/Y deltas.
+    // The wheel and pan have nowhere to go, so they're dropped.
+    report_x = CLAMP(report_x, SCHAR_MIN, SCHAR_MAX);
+    report_y = CLAMP(report_y, SCHAR_MIN, SCHAR_MAX);
+    uint8_t boot_report[3] = { uint8_t(buttons & ~button_function), uint8_t(int8_t(report_x)), uint8_t(int8_t(report_y)) };
+    queued = tud_hid_report(0, boot_report, sizeof(boot_report));
+  }
+  else
+  {
     typedef struct TU_ATTR_PACKED
     {
       uint8_t buttons;    /**< buttons mask for currently pressed buttons in the mouse. */
-      delta_t  x;         /**< Current delta x movement of the mouse. */
-      delta_t  y;         /**< Current delta y movement on the mouse. */
-#if USE_SCROLL_RESOLUTION_MULTIPLIER
-      uint8_t  multiplier; /**< Mouse wheel resolution multiplier */
-#endif
+      int16_t  x;         /**< Current delta x movement of the mouse. */
+      int16_t  y;         /**< Current delta y movement on the mouse. */
       int8_t  wheel;      /**< Current delta wheel movement on the mouse. */
       int8_t  pan;        // using AC Pan
     } report_t;
 
     report_t report =
     {
-      .buttons = buttons,
-      .x       = delta_t(CLAMP(delta.x, delta_min, delta_max)),
-      .y       = delta_t(CLAMP(delta.y, delta_min, delta_max)),
-#if USE_SCROLL_RESOLUTION_MULTIPLIER
-      .multiplier = uint8_t(scroll_tick - 1),
-      .wheel   = int8_t(CLAMP(delta.z, SCHAR_MIN, SCHAR_MAX)),
+      .buttons = uint8_t(buttons & ~button_function),
+      .x       = int16_t(report_x),
+      .y       = int16_t(report_y),
+      .wheel   = int8_t(wheel),
+      .pan     = int8_t(pan)
+    };
+
+    // if (report.wheel != 0)
+    // {
+    //   debugLogger.print("reporting wheel = ");
+    //   debugLogger.print(report.wheel);
+    //   debugLogger.print(", hires = ");
+    //   debugLogger.print(hires_scroll);
+    //   debugLogger.println("");
+    // }
+
+    queued = tud_hid_report(0, &report, sizeof(report));
+  }
+#endif
+
+  if (queued)
+  {
+#if defined(STAGE_HISTOGRAMS)
+    if (pending_report.buttons_changed)
+    {
+      stage_times[stage_button_latency].add(micros() - button_input.change_micros);
+    }
+#endif
+    pending_report.report_sent(report_x, report_y, wheel, pan);
+  }
+  else
+  {
+    pending_report.report_merged();
+  }
+  return queued;
+}
+
+#if defined(STAGE_HISTOGRAMS)
+// Checks the serial port for a command: 'h' prints the stage histograms, and 'r' clears them.
+// Printing takes a while, so the reports around it will be late (and show up in the histograms as overruns).
+void stage_histogram_command()
+{
+  if (!tud_cdc_connected() || !Serial.available())
+  {
+    return;
+  }
+
+  int command = Serial.read();
+  if (command == 'h')
+  {
+    Serial.printf("Stage times (budget %lu us, %lu overruns):\n", 1000000UL / report_Hz, stage_overruns);
+    Serial.printf("Reports: %lu sent, %lu merged, %lu dropped\n", 
+      pending_report.sent, pending_report.merged, pending_report.dropped);
+    for (int i = 0; i < stage_count; i++)
+    {
+      stage_times[i].print(Serial, stage_names[i]);
+    }
+  }
+  else if (command == 'r')
+  {
+    for (int i = 0; i < stage_count; i++)
+    {
+      stage_times[i].reset();
+    }
+    stage_overruns = 0;
+    Serial.printf("Stage histograms cleared\n");
+  }
+}
+#endif
+
+void loop() 
+{
+#if !defined(DUAL_CORE)
+  // Bring up the sensors, if they're not already running.
+  static int s1_retries = sensor_init_retries;
+  static int s2_retries = sensor_init_retries;
+  init_sensor_step(s1, s1_retries, 1);
+  init_sensor_step(s2, s2_retries, 2);
+#endif
+
+  // Between samples, just keep any queued register transactions moving.
+  if (!scheduler.sample_due())
+  {
+#if !defined(DUAL_CORE)
+    s1.service();
+    s2.service();
+#endif
+
+    // Button changes go out right away, instead of waiting for the next sample.
+    if (poll_buttons() && USBDevice.suspended())
+    {
+      USBDevice.remoteWakeup();
+    }
+    if (pending_report.buttons_changed && tud_hid_ready())
+    {
+      send_report();
+    }
+#if defined(STAGE_HISTOGRAMS)
+    stage_histogram_command();
+#endif
+    Watchdog.reset();
+    return;
+  }
+
+  unsigned long loop_start_time = micros();
+  bool sendWakeup = false;
+  MotionVector delta;
+  int scroll = 0;
+
+#if !defined(DUAL_CORE)
+#if SENSOR_DISPLAY
+  if(!sensor_display_mode)
+#endif
+  {
+    // Start the burst read from sensor 1 now, so the transfer can overlap with polling the buttons.
+    s1.begin_motion();
+  }
+#endif
+  STAGE_BEGIN(stage_mark);
+
+  if (poll_buttons())
+  {
+    sendWakeup = true;
+  }
+  STAGE_END(stage_buttons, stage_mark);
+
+#if SENSOR_DISPLAY
+  if(sensor_display_mode)
+  {
+    display_sensors();
+    STAGE_RESTART(stage_mark);
+  }
+  else
+#endif
+  {
+#if defined(DUAL_CORE)
+    // Core1 has been reading the sensors. Collect everything it's found since the last report.
+    motion_sample sample;
+    while (motion_samples.pop(sample))
+    {
+#if defined(LOG_REPORT_LATENCY)
+      unsigned long age = micros() - sample.time;
+      if (age > sample_age_max)
+      {
+        sample_age_max = age;
+      }
+#endif
+      apply_motion(sample.delta, sample.time, delta);
+    }
 #else
-      .wheel   = int8_t(CLAMP(scroll, SCHAR_MIN, SCHAR_MAX)),
+    // read_sensors() records its own stages.
+    MotionVector sensor_delta = read_sensors();
+    STAGE_RESTART(stage_mark);
+    apply_motion(sensor_delta, loop_start_time, delta);
 #endif
-      .pan     = 0
-    };
 
-//     if (report.wheel != 0)
-//     {
-//       debugLogger.print("reporting wheel = ");
-//       debugLogger.print(report.wheel);
-// #if USE_SCROLL_RESOLUTION_MULTIPLIER
-//       debugLogger.print(", multiplier = ");
-//       debugLogger.print(report.multiplier);
-// #endif
-//       debugLogger.println("");
-//     }
+    bool scroll_click;
+    scroll = scroller.update(hires_scroll, scroll_click);
+    if (scroll_click)
+    {
+      click();
+    }
+    STAGE_END(stage_scroll, stage_mark);
+  }
 
-    (void)tud_hid_report(0, &report, sizeof(report));
+#if defined(POINTER_ACCELERATION)
+  if (delta.x != 0 || delta.y != 0)
+  {
+    // Each sample covers one report interval, so that's the time the speed is measured over.
+    motion_t gain = motion_t(fixed16::from_raw(
+      pointer_acceleration.gain(fixed16(delta.x).raw, fixed16(delta.y).raw, 1000000UL / report_Hz)));
+    delta.x = delta.x * gain;
+    delta.y = delta.y * gain;
+  }
+  STAGE_END(stage_acceleration, stage_mark);
+#endif
+
+#if FUNCTION_BUTTON_ACTION == 1
+  if (buttons & button_function)
+  {
+    // Precision mode
+    delta.x = delta.x / FUNCTION_PRECISION_DIVISOR;
+    delta.y = delta.y / FUNCTION_PRECISION_DIVISOR;
+  }
+#endif
+
+  // Add this loop's motion to whatever hasn't been reported yet.
+  pending_report.add_motion(delta.x, delta.y);
+  pending_report.add_wheel(scroll);
+  
+#if !defined(DUAL_CORE)
+  // Advance any queued register transactions (CPI changes, register dumps, etc.)
+  // These never wait on the sensor, so they can't stall the report.
+  s1.service();
+  s2.service();
+#endif
+
+  if (sendWakeup && USBDevice.suspended())
+  {
+    USBDevice.remoteWakeup();
+  }
+  if (USBDevice.suspended() || !USBDevice.mounted())
+  {
+    // Nobody's listening. Button changes wait for the host, but motion from now would be stale by then.
+    pending_report.drop_motion();
+    if (!USBDevice.mounted())
+    {
+      // The host will decide about high resolution scrolling again when it enumerates the device.
+      hires_scroll = false;
+    }
+  }
+  else if (pending_report.pending())
+  {
+    // Track how long it takes from power-on to the first report reaching the host.
+    static bool first_report = true;
+    if (first_report)
+    {
+      first_report = false;
+      debugLogger.printf("First report %lu ms after boot (sensor firmware uploads took %lu us and %lu us)\n",
+        millis(), s1.upload_micros, s2.upload_micros);
+    }
+
+    if (send_report())
+    {
+      scheduler.report_queued(loop_start_time);
+    }
+  }
+  STAGE_END(stage_report, stage_mark);
+
+#if defined(LOG_REPORT_LATENCY)
+  static unsigned long last_latency_log = 0;
+  if (millis() - last_latency_log >= 10000)
+  {
+    last_latency_log = millis();
+    debugLogger.printf("Sample to IN latency: last %lu us, min %lu us, max %lu us\n",
+      scheduler.latency_micros, scheduler.latency_min, scheduler.latency_max);
+    scheduler.reset_latency();
+    debugLogger.printf("Reports: %lu sent, %lu merged, %lu dropped\n", 
+      pending_report.sent, pending_report.merged, pending_report.dropped);
+#if defined(DUAL_CORE)
+    debugLogger.printf("Longest wait for a sample from core1: %lu us\n", sample_age_max);
+    sample_age_max = 0;
 #endif
   }
+#endif
 #if SENSOR_DISPLAY  
   if (display_ready)
   {
@@ -1156,6 +2224,7 @@ void loop()
   }
 #endif
 
+  STAGE_RESTART(stage_mark);
 #if defined(BUTTON_LIGHTS)
   // Update the lighting
   pixel.setPixelColor(0, ledRed * 0xFF, ledGreen * 0xFF, ledBlue * 0xFF);
@@ -1174,13 +2243,18 @@ void loop()
   if (ledBlue < 0)
     ledBlue = 0; 
 #endif
+  STAGE_END(stage_leds, stage_mark);
 
-  // Delay to keep the loop time right around report_microseconds
+  // The scheduler decides when the next loop starts, so there's no delay here.
   loop_time = micros() - loop_start_time;
-  if (loop_time < report_microseconds)
+
+#if defined(STAGE_HISTOGRAMS)
+  stage_times[stage_total].add(loop_time);
+  if (loop_time > (1000000UL / report_Hz))
   {
-    delayMicroseconds(report_microseconds - loop_time);
+    stage_overruns++;
   }
+#endif
  
     Watchdog.reset();
 }
@@ -0,0 +1,150 @@
+// Checks the acceleration lookup table against the curves it's built from, and times it against evaluating them directly.
+#include <unity.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "acceleration.h"
+
+void setUp() {}
+void tearDown() {}
+
+// Small deterministic generator, so the runs are repeatable.
+static uint32_t random_state = 24680;
+static int32_t random_counts_q16(int range)
+{
+  random_state = random_state * 1103515245 + 12345;
+  return int32_t((random_state >> 8) % (2 * range + 1)) - range;
+}
+
+// The speed gain() works out for a sample, with the same approximation of the distance.
+static float approximate_speed(int32_t x, int32_t y, uint32_t interval_micros)
+{
+  float big = fabsf(x / 65536.0f);
+  float small = fabsf(y / 65536.0f);
+  if (small > big)
+  {
+    float temp = big;
+    big = small;
+    small = temp;
+  }
+  float distance = (big * 15 / 16) + (small * 15 / 32);
+  if (distance < big)
+  {
+    distance = big;
+  }
+  return distance * 1000 / interval_micros;
+}
+
+static void check_curve(const acceleration_curve::settings_t &settings, float tolerance)
+{
+  acceleration_curve curve;
+  curve.set_curve(settings);
+  for (int i = 0; i < 5000; i++)
+  {
+    // Up to 40 counts in an 8ms report is 5 counts/ms, within the table.
+    int32_t x = random_counts_q16(40 << 16);
+    int32_t y = random_counts_q16(40 << 16);
+    float expected = acceleration_curve::evaluate(settings, approximate_speed(x, y, 8000));
+    TEST_ASSERT_FLOAT_WITHIN(tolerance, expected, curve.gain(x, y, 8000) / 65536.0f);
+  }
+}
+
+void test_linear()
+{
+  acceleration_curve::settings_t settings = { acceleration_curve::linear, 1.5f, 0, 0, 0, NULL, 0 };
+  check_curve(settings, 0.001f);
+}
+
+void test_power()
+{
+  acceleration_curve::settings_t settings = { acceleration_curve::power, 1.0f, 4.0f, 4.0f, 1.5f, NULL, 0 };
+  // Interpolating between table entries 0.5 counts/ms apart.
+  check_curve(settings, 0.02f);
+}
+
+void test_sigmoid()
+{
+  acceleration_curve::settings_t settings = { acceleration_curve::sigmoid, 1.0f, 3.0f, 2.0f, 0.5f, NULL, 0 };
+  // The middle of this one is steep compared to the 0.5 counts/ms between table entries.
+  check_curve(settings, 0.03f);
+}
+
+void test_points()
+{
+  static const acceleration_curve::point_t points[] = { { 0.5f, 1.0f }, { 2.0f, 2.0f }, { 4.0f, 2.5f } };
+  acceleration_curve::settings_t settings = { acceleration_curve::points, 0, 0, 0, 0, points, 3 };
+  // The points are on table entries, so this is only off by the speed being rounded to 1/256 count/ms.
+  check_curve(settings, 0.005f);
+}
+
+void test_beyond_table()
+{
+  acceleration_curve::settings_t settings = { acceleration_curve::power, 1.0f, 4.0f, 4.0f, 1.5f, NULL, 0 };
+  acceleration_curve curve;
+  curve.set_curve(settings);
+  // 1000 counts in 1ms is far past the end of the table, which should give the last gain.
+  TEST_ASSERT_FLOAT_WITHIN(0.001f, acceleration_curve::evaluate(settings, 32.0f), curve.gain(1000 << 16, 0, 1000) / 65536.0f);
+  // A zero interval shouldn't divide by zero.
+  curve.gain(1 << 16, 0, 0);
+}
+
+static double seconds()
+{
+  return double(clock()) / CLOCKS_PER_SEC;
+}
+
+void test_benchmark()
+{
+  // These numbers are for whatever host runs the test, which has a hardware FPU.
+  // They say nothing about the SAMD21, where powf() and the float math around it are done in software.
+  enum { samples = 4096, passes = 500 };
+  static int32_t xs[samples];
+  static int32_t ys[samples];
+  for (int i = 0; i < samples; i++)
+  {
+    xs[i] = random_counts_q16(40 << 16);
+    ys[i] = random_counts_q16(40 << 16);
+  }
+
+  acceleration_curve::settings_t settings = { acceleration_curve::power, 1.0f, 4.0f, 4.0f, 1.5f, NULL, 0 };
+  acceleration_curve curve;
+  curve.set_curve(settings);
+  volatile int32_t sink = 0;
+  volatile float float_sink = 0;
+
+  double start = seconds();
+  for (int p = 0; p < passes; p++)
+  {
+    for (int i = 0; i < samples; i++)
+    {
+      sink = sink + curve.gain(xs[i], ys[i], 8000);
+    }
+  }
+  double table_ns = ((seconds() - start) * 1e9) / (double(samples) * passes);
+
+  start = seconds();
+  for (int p = 0; p < passes; p++)
+  {
+    for (int i = 0; i < samples; i++)
+    {
+      float speed = sqrtf((float(xs[i]) * xs[i]) + (float(ys[i]) * ys[i])) / 65536.0f / 8.0f;
+      float_sink = float_sink + acceleration_curve::evaluate(settings, speed);
+    }
+  }
+  double direct_ns = ((seconds() - start) * 1e9) / (double(samples) * passes);
+
+  printf("host: table %.2f ns/sample, direct powf %.2f ns/sample\n", table_ns, direct_ns);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_linear);
+  RUN_TEST(test_power);
+  RUN_TEST(test_sigmoid);
+  RUN_TEST(test_points);
+  RUN_TEST(test_beyond_table);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,99 @@
+// Decodes motion bursts from a scripted SPI byte stream.
+#include <unity.h>
+
+#include "adns_burst.h"
+
+// Stands in for the sensor on the other end of the bus. Each transfer() clocks out the next scripted byte.
+struct scripted_spi
+{
+  const uint8_t *script;
+  int length;
+  int position;
+
+  uint8_t transfer(uint8_t)
+  {
+    return (position < length)?script[position++]:0;
+  }
+};
+
+// Reads a burst the same way adns::read_motion_burst() does when it isn't using DMA.
+static void read_burst(scripted_spi &spi, adns_burst &result)
+{
+  uint8_t data[adns_burst::size];
+  for (int i = 0; i < adns_burst::size; i++)
+  {
+    data[i] = spi.transfer(0);
+  }
+  result.decode_burst(data);
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_positive_motion()
+{
+  // Motion, Observation, Delta_X_L, Delta_X_H, Delta_Y_L, Delta_Y_H, SQUAL, Raw_Data_Sum, Maximum_Raw_Data,
+  // Minimum_Raw_Data, Shutter_Upper, Shutter_Lower, Frame_Period_Upper, Frame_Period_Lower
+  const uint8_t script[] = { 0x80, 0x3f, 0x34, 0x12, 0x05, 0x00, 0x40, 0x55, 0x7f, 0x10, 0x01, 0x02, 0x1f, 0x40 };
+  scripted_spi spi = { script, sizeof(script), 0 };
+  adns_burst burst;
+  read_burst(spi, burst);
+
+  TEST_ASSERT_EQUAL_HEX8(0x80, burst.Motion);
+  TEST_ASSERT_EQUAL_HEX8(0x3f, burst.Observation);
+  TEST_ASSERT_EQUAL_INT(0x1234, burst.x);
+  TEST_ASSERT_EQUAL_INT(5, burst.y);
+  TEST_ASSERT_EQUAL_UINT8(0x40, burst.SQUAL);
+  TEST_ASSERT_EQUAL_UINT8(0x55, burst.Pixel_Sum);
+  TEST_ASSERT_EQUAL_UINT8(0x7f, burst.Maximum_Pixel);
+  TEST_ASSERT_EQUAL_UINT8(0x10, burst.Minimum_Pixel);
+  TEST_ASSERT_EQUAL_INT(0x0102, burst.Shutter);
+  TEST_ASSERT_EQUAL_INT(8000, burst.Frame_Period);
+}
+
+void test_negative_motion()
+{
+  // -1 and -32768 in X and Y
+  const uint8_t script[] = { 0x80, 0x00, 0xff, 0xff, 0x00, 0x80, 0x20, 0, 0, 0, 0, 0x40, 0, 0 };
+  scripted_spi spi = { script, sizeof(script), 0 };
+  adns_burst burst;
+  read_burst(spi, burst);
+
+  TEST_ASSERT_EQUAL_INT(-1, burst.x);
+  TEST_ASSERT_EQUAL_INT(-32768, burst.y);
+  TEST_ASSERT_EQUAL_INT(0x40, burst.Shutter);
+}
+
+void test_consecutive_bursts()
+{
+  // Two bursts back to back in one stream. Each one picks up where the last left off.
+  const uint8_t script[] =
+  {
+    0x80, 0, 0x10, 0x00, 0xf0, 0xff, 0x30, 0, 0, 0, 0, 0x20, 0, 0,
+    0x00, 0, 0x00, 0x00, 0x00, 0x00, 0x31, 0, 0, 0, 0, 0x21, 0, 0
+  };
+  scripted_spi spi = { script, sizeof(script), 0 };
+  adns_burst burst;
+
+  read_burst(spi, burst);
+  TEST_ASSERT_EQUAL_INT(16, burst.x);
+  TEST_ASSERT_EQUAL_INT(-16, burst.y);
+  TEST_ASSERT_EQUAL_UINT8(0x30, burst.SQUAL);
+
+  read_burst(spi, burst);
+  TEST_ASSERT_EQUAL_HEX8(0x00, burst.Motion);
+  TEST_ASSERT_EQUAL_INT(0, burst.x);
+  TEST_ASSERT_EQUAL_INT(0, burst.y);
+  TEST_ASSERT_EQUAL_UINT8(0x31, burst.SQUAL);
+  TEST_ASSERT_EQUAL_INT(0x21, burst.Shutter);
+  TEST_ASSERT_EQUAL_INT(int(sizeof(script)), spi.position);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_positive_motion);
+  RUN_TEST(test_negative_motion);
+  RUN_TEST(test_consecutive_bursts);
+  return UNITY_END();
+}
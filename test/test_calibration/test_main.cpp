@@ -0,0 +1,191 @@
+// Runs the transform calibration on synthetic rolls and twists from the geometry model.
+#include <unity.h>
+#include <math.h>
+
+#include "calibration.h"
+#include "sensor_layout.h"
+
+void setUp() {}
+void tearDown() {}
+
+// Small deterministic generator, so the runs are repeatable.
+static uint32_t random_state = 13579;
+static double random_unit()
+{
+  random_state = random_state * 1103515245 + 12345;
+  return double((random_state >> 8) % 2001) / 1000.0 - 1.0;
+}
+
+// The trackball as built, with sensor 2 turned a few degrees from where the built-in transform thinks it is.
+static const sensor_position s2_actual = { S2A, S2E, S2R + 8 };
+
+// The built-in transform, which is what calibration starts from.
+static void built_in_transform(float transform[3][4])
+{
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 4; j++)
+    {
+      transform[i][j] = float(geometry_transform(s1_position, s2_position, handedness, i, j));
+    }
+  }
+}
+
+// Feeds one step with motion along a single axis (0 = X, 1 = Y, 2 = Z), of random size and direction,
+// with a little of the other two axes mixed in (nobody rolls perfectly straight).
+static void roll(transform_calibration &calibration, int axis, int count)
+{
+  for (int n = 0; n < count; n++)
+  {
+    double motion[3];
+    for (int i = 0; i < 3; i++)
+    {
+      motion[i] = random_unit() * 2;
+    }
+    motion[axis] = random_unit() * 40;
+
+    int32_t reading[4];
+    for (int j = 0; j < 4; j++)
+    {
+      double value = 0;
+      for (int i = 0; i < 3; i++)
+      {
+        value += geometry_model(s1_position, s2_actual, handedness, j, i) * motion[i];
+      }
+      // Counts as 24.8 fixed point, the way read_sensors() passes them in.
+      reading[j] = int32_t(lround(value * 256));
+    }
+    calibration.add(reading[0], reading[1], reading[2], reading[3]);
+  }
+}
+
+// One entry of transform * (actual model), which would be the identity for a perfect transform.
+static double model_product(const float transform[3][4], int output, int axis)
+{
+  double value = 0;
+  for (int j = 0; j < 4; j++)
+  {
+    value += transform[output][j] * geometry_model(s1_position, s2_actual, handedness, j, axis);
+  }
+  return value;
+}
+
+// Largest crosstalk between axes, i.e. the largest entry of transform * (actual model) off the diagonal.
+static double crosstalk(const float transform[3][4])
+{
+  double worst = 0;
+  for (int i = 0; i < 3; i++)
+  {
+    for (int k = 0; k < 3; k++)
+    {
+      if (i != k && fabs(model_product(transform, i, k)) > worst)
+      {
+        worst = fabs(model_product(transform, i, k));
+      }
+    }
+  }
+  return worst;
+}
+
+void test_solves_rotated_sensor()
+{
+  float current[3][4];
+  float result[3][4];
+  built_in_transform(current);
+
+  transform_calibration calibration;
+  calibration.start();
+  for (int axis = 0; axis < 3; axis++)
+  {
+    TEST_ASSERT_EQUAL_INT(axis, calibration.phase);
+    roll(calibration, axis, 500);
+    calibration.next();
+  }
+  TEST_ASSERT_EQUAL_INT(transform_calibration::idle, calibration.phase);
+  TEST_ASSERT_TRUE(calibration.solve(current, result));
+
+  // result * (actual model) should be close to the identity.
+  // The built-in transform has crosstalk of almost 0.1 on this ball, and calibration should take nearly all of it out.
+  TEST_ASSERT_TRUE(crosstalk(current) > 0.09);
+  TEST_ASSERT_DOUBLE_WITHIN(0.01, 0.0, crosstalk(result));
+  // Each axis keeps the gain the current transform gave it (see calibration.h), which here is within a few percent of 1.
+  // The rolls aren't perfectly straight, which moves that a little.
+  for (int axis = 0; axis < 3; axis++)
+  {
+    TEST_ASSERT_DOUBLE_WITHIN(0.01, model_product(current, axis, axis), model_product(result, axis, axis));
+    TEST_ASSERT_DOUBLE_WITHIN(0.05, 1.0, model_product(result, axis, axis));
+  }
+}
+
+void test_too_few_samples()
+{
+  float current[3][4];
+  float result[3][4];
+  built_in_transform(current);
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 4; j++)
+    {
+      result[i][j] = 123;
+    }
+  }
+
+  transform_calibration calibration;
+  calibration.start();
+  roll(calibration, 0, 500);
+  calibration.next();
+  roll(calibration, 1, transform_calibration::minimum_samples - 1);
+  calibration.next();
+  roll(calibration, 2, 500);
+  calibration.next();
+  TEST_ASSERT_FALSE(calibration.solve(current, result));
+
+  // A failed solve leaves the result alone.
+  for (int i = 0; i < 3; i++)
+  {
+    for (int j = 0; j < 4; j++)
+    {
+      TEST_ASSERT_EQUAL_FLOAT(123, result[i][j]);
+    }
+  }
+}
+
+void test_wrong_axis()
+{
+  float current[3][4];
+  float result[3][4];
+  built_in_transform(current);
+
+  // Rolling up and down when it asked for left and right.
+  transform_calibration calibration;
+  calibration.start();
+  roll(calibration, 1, 500);
+  calibration.next();
+  roll(calibration, 1, 500);
+  calibration.next();
+  roll(calibration, 2, 500);
+  calibration.next();
+  TEST_ASSERT_FALSE(calibration.solve(current, result));
+}
+
+void test_idle_ignores_samples()
+{
+  transform_calibration calibration;
+  roll(calibration, 0, 10);
+  TEST_ASSERT_EQUAL_UINT32(0, calibration.samples[0]);
+
+  // Samples with no motion at all don't count either.
+  calibration.start();
+  calibration.add(0, 0, 0, 0);
+  TEST_ASSERT_EQUAL_UINT32(0, calibration.samples[0]);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_solves_rotated_sensor);
+  RUN_TEST(test_too_few_samples);
+  RUN_TEST(test_wrong_axis);
+  RUN_TEST(test_idle_ignores_samples);
+  return UNITY_END();
+}
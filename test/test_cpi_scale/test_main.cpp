@@ -0,0 +1,146 @@
+// Checks the 16.16 CPI scaling against the double path it replaced, and times the two.
+#include <unity.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "cpi_scale.h"
+
+void setUp() {}
+void tearDown() {}
+
+// Small deterministic generator, so the runs are repeatable.
+static uint32_t random_state = 12345;
+static int random_counts(int range)
+{
+  random_state = random_state * 1103515245 + 12345;
+  return int((random_state >> 8) % (2 * range + 1)) - range;
+}
+
+void test_total_matches_double()
+{
+  // The running total of the reported counts should never be more than one count away from the exact total,
+  // plus whatever the rounding of the factor itself adds up to (half a count per 65536 counts moved).
+  const int current_cpis[] = { 100, 800, 3200, 5000, 12000, 16000 };
+  for (unsigned int c = 0; c < sizeof(current_cpis) / sizeof(current_cpis[0]); c++)
+  {
+    int32_t scale = cpi_scale_factor(800, current_cpis[c]);
+    int32_t remainder = 0;
+    long long total_counts = 0;
+    long long total_reported = 0;
+    for (int i = 0; i < 10000; i++)
+    {
+      int counts = random_counts(2000);
+      total_counts += counts;
+      total_reported += scale_counts(counts, scale, remainder);
+      double exact = (double(total_counts) * 800) / current_cpis[c];
+      double drift = double(total_counts < 0?-total_counts:total_counts) / 131072;
+      TEST_ASSERT_DOUBLE_WITHIN(1.0 + drift, exact, double(total_reported));
+    }
+  }
+}
+
+void test_slow_motion_adds_up()
+{
+  // At 12000 cpi, one count is 1/15 of a count at 800. Fifteen single counts should report one, not zero.
+  // The factor is 4369, so fifteen of them come to 65535, just short of a whole count.
+  int32_t scale = cpi_scale_factor(800, 12000);
+  int32_t remainder = 0;
+  int total = 0;
+  for (int i = 0; i < 15; i++)
+  {
+    total += scale_counts(1, scale, remainder);
+  }
+  TEST_ASSERT_EQUAL_INT(1, total);
+
+  // The same, backwards, which should come out the same size.
+  remainder = 0;
+  total = 0;
+  for (int i = 0; i < 15; i++)
+  {
+    total += scale_counts(-1, scale, remainder);
+  }
+  TEST_ASSERT_EQUAL_INT(-1, total);
+
+  // It shouldn't report anything before half a count in either direction.
+  remainder = 0;
+  total = 0;
+  for (int i = 0; i < 7; i++)
+  {
+    total += scale_counts(1, scale, remainder);
+  }
+  TEST_ASSERT_EQUAL_INT(0, total);
+  remainder = 0;
+  total = 0;
+  for (int i = 0; i < 7; i++)
+  {
+    total += scale_counts(-1, scale, remainder);
+  }
+  TEST_ASSERT_EQUAL_INT(0, total);
+}
+
+void test_unknown_cpi()
+{
+  int32_t remainder = 0;
+  TEST_ASSERT_EQUAL_INT32(0, cpi_scale_factor(800, 0));
+  TEST_ASSERT_EQUAL_INT(0, scale_counts(100, cpi_scale_factor(800, 0), remainder));
+}
+
+// The path this replaced: multiply by a double, truncate, and drop the fraction.
+static int scale_double(int counts, double factor)
+{
+  return int(counts * factor);
+}
+
+static double seconds()
+{
+  return double(clock()) / CLOCKS_PER_SEC;
+}
+
+void test_benchmark()
+{
+  // These numbers are for whatever host runs the test, which has a hardware FPU.
+  // They say nothing about the SAMD21, where the double multiply is done in software.
+  enum { samples = 4096, passes = 2000 };
+  static int counts[samples];
+  for (int i = 0; i < samples; i++)
+  {
+    counts[i] = random_counts(2000);
+  }
+
+  volatile int32_t scale = cpi_scale_factor(800, 12000);
+  volatile double factor = 800.0 / 12000.0;
+  volatile int sink = 0;
+
+  double start = seconds();
+  int32_t remainder = 0;
+  for (int p = 0; p < passes; p++)
+  {
+    for (int i = 0; i < samples; i++)
+    {
+      sink = sink + scale_counts(counts[i], scale, remainder);
+    }
+  }
+  double fixed_ns = ((seconds() - start) * 1e9) / (double(samples) * passes);
+
+  start = seconds();
+  for (int p = 0; p < passes; p++)
+  {
+    for (int i = 0; i < samples; i++)
+    {
+      sink = sink + scale_double(counts[i], factor);
+    }
+  }
+  double double_ns = ((seconds() - start) * 1e9) / (double(samples) * passes);
+
+  printf("host: scale_counts %.2f ns/call, double %.2f ns/call\n", fixed_ns, double_ns);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_total_matches_double);
+  RUN_TEST(test_slow_motion_adds_up);
+  RUN_TEST(test_unknown_cpi);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,92 @@
+// Checks fixed16 against float, the way the sensor transform uses it.
+#include <unity.h>
+
+#include "fixed16.h"
+
+void setUp() {}
+void tearDown() {}
+
+// Small deterministic generator, so the runs are repeatable.
+static uint32_t random_state = 54321;
+static int random_int(int range)
+{
+  random_state = random_state * 1103515245 + 12345;
+  return int((random_state >> 8) % (2 * range + 1)) - range;
+}
+
+void test_int_conversion()
+{
+  TEST_ASSERT_EQUAL_INT32(100 * 65536, fixed16(100).raw);
+  TEST_ASSERT_EQUAL_INT32(-32767 * 65536, fixed16(-32767).raw);
+  TEST_ASSERT_EQUAL_INT(-5, int(fixed16(-5)));
+  // Like float, conversion to int truncates toward zero.
+  TEST_ASSERT_EQUAL_INT(-1, int(fixed16(-1.75f)));
+  TEST_ASSERT_EQUAL_INT(1, int(fixed16(1.75f)));
+}
+
+void test_saturation()
+{
+  // These used to overflow int32_t.
+  TEST_ASSERT_EQUAL_INT32(INT32_MAX, fixed16(32768).raw);
+  TEST_ASSERT_EQUAL_INT32(INT32_MAX, fixed16(1000000).raw);
+  TEST_ASSERT_EQUAL_INT32(-INT32_MAX, fixed16(-32768).raw);
+  TEST_ASSERT_EQUAL_INT32(-INT32_MAX, fixed16(-1000000).raw);
+  TEST_ASSERT_EQUAL_INT32(INT32_MAX, fixed16(40000.0f).raw);
+  TEST_ASSERT_EQUAL_INT32(-INT32_MAX, fixed16(-1e9f).raw);
+  TEST_ASSERT_EQUAL_INT32(INT32_MAX, fixed16(1e12).raw);
+  TEST_ASSERT_EQUAL_INT32(-INT32_MAX, fixed16(-32768.0).raw);
+
+  // A saturated value can still be negated and truncated.
+  TEST_ASSERT_EQUAL_INT32(INT32_MAX, (-fixed16(-40000)).raw);
+  TEST_ASSERT_EQUAL_INT(-32767, int(fixed16(-40000)));
+}
+
+void test_transform_matches_float()
+{
+  // The 3x4 sensor transform, done both ways, for random matrices in the range the geometry produces
+  // and random readings up to what the sensors report in one burst.
+  for (int trial = 0; trial < 200; trial++)
+  {
+    float st_float[3][4];
+    fixed16 st_fixed[3][4];
+    for (int i = 0; i < 3; i++)
+    {
+      for (int j = 0; j < 4; j++)
+      {
+        st_float[i][j] = random_int(1500) / 1000.0f;
+        st_fixed[i][j] = fixed16(st_float[i][j]);
+      }
+    }
+
+    for (int sample = 0; sample < 200; sample++)
+    {
+      int v[4];
+      for (int j = 0; j < 4; j++)
+      {
+        v[j] = random_int(2000);
+      }
+
+      for (int i = 0; i < 3; i++)
+      {
+        float result_float = 0;
+        fixed16 result_fixed;
+        for (int j = 0; j < 4; j++)
+        {
+          result_float += st_float[i][j] * float(v[j]);
+          result_fixed += st_fixed[i][j] * fixed16(v[j]);
+        }
+        TEST_ASSERT_INT_WITHIN(1, int(result_float), int(result_fixed));
+        TEST_ASSERT_FLOAT_WITHIN(1.0f, result_float, float(result_fixed));
+      }
+    }
+  }
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_int_conversion);
+  RUN_TEST(test_saturation);
+  RUN_TEST(test_transform_matches_float);
+  return UNITY_END();
+}
@@ -0,0 +1,233 @@
+// Replays motion traces through the sensor transform and the scroll/pointer classifier, the way the firmware does.
+//
+// Traces are in the format LOG_MOTION_TRACE writes: "trace <micros> <v1.x> <v1.y> <v2.x> <v2.y>", 16.16 fixed point.
+// Any other lines (i.e. the rest of a serial log) are skipped.
+// To replay a captured log instead of the built-in trace, add -DTRACE_FILE=\"path/to/log.txt\" to the native env's build_flags.
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fixed16.h"
+#include "sensor_layout.h"
+#include "classifier.h"
+
+void setUp() {}
+void tearDown() {}
+
+struct trace_sample
+{
+  unsigned long micros;
+  long v[4];
+};
+
+static bool parse_trace_line(const char *line, trace_sample &sample)
+{
+  return sscanf(line, "trace %lu %ld %ld %ld %ld", &sample.micros, &sample.v[0], &sample.v[1], &sample.v[2], &sample.v[3]) == 5;
+}
+
+// The same transform read_sensors() uses (fixed point, as on the SAMD21 builds).
+#define ST(output, reading) fixed16(geometry_transform(s1_position, s2_position, handedness, output, reading))
+static const fixed16 st[3][4] =
+{
+  { ST(0, 0), ST(0, 1), ST(0, 2), ST(0, 3) },
+  { ST(1, 0), ST(1, 1), ST(1, 2), ST(1, 3) },
+  { ST(2, 0), ST(2, 1), ST(2, 2), ST(2, 3) }
+};
+#undef ST
+
+// Runs every sample in the trace through the transform and a fresh classifier, and stores the mode for each one.
+// Returns the number of samples.
+static int replay(const char *trace, motion_classifier::mode_t *modes, int max_modes)
+{
+  motion_classifier classifier;
+  int count = 0;
+  const char *line = trace;
+  while (line && *line && count < max_modes)
+  {
+    trace_sample sample;
+    if (parse_trace_line(line, sample))
+    {
+      fixed16 v[4];
+      for (int j = 0; j < 4; j++)
+      {
+        v[j] = fixed16::from_raw(int32_t(sample.v[j]));
+      }
+      fixed16 out[3];
+      for (int i = 0; i < 3; i++)
+      {
+        out[i] = st[i][0] * v[0] + st[i][1] * v[1] + st[i][2] * v[2] + st[i][3] * v[3];
+      }
+      // apply_motion() doesn't classify samples with no motion.
+      if (out[0].raw != 0 || out[1].raw != 0 || out[2].raw != 0)
+      {
+        classifier.classify(out[0].raw, out[1].raw, out[2].raw, uint32_t(sample.micros));
+      }
+      modes[count++] = classifier.mode;
+    }
+    line = strchr(line, '\n');
+    if (line)
+    {
+      line++;
+    }
+  }
+  return count;
+}
+
+// A synthetic trace, not a recording: generated from the geometry model with the built-in sensor layout,
+// at exactly 8000us apart (125Hz), with uniform noise added to each reading.
+// 20 samples rolling the ball, 30 twisting it (with one sample in the middle that looks like a roll), then 20 rolling again.
+// Real captures should be replayed with TRACE_FILE.
+static const char twist_trace[] =
+  "trace 1000000 76477 134659 -218397 -81315\n"
+  "trace 1008000 53906 124010 -239467 -74135\n"
+  "trace 1016000 61656 122808 -228424 -81463\n"
+  "trace 1024000 65004 118939 -220290 -68753\n"
+  "trace 1032000 76037 140817 -228380 -76948\n"
+  "trace 1040000 80736 123557 -225772 -63327\n"
+  "trace 1048000 52541 122867 -242209 -61273\n"
+  "trace 1056000 75980 116063 -243031 -57822\n"
+  "trace 1064000 65964 117149 -226638 -85410\n"
+  "trace 1072000 53821 141065 -238042 -64670\n"
+  "trace 1080000 71247 122191 -232988 -62378\n"
+  "trace 1088000 77161 142726 -224179 -69504\n"
+  "trace 1096000 67913 118807 -243942 -61542\n"
+  "trace 1104000 72652 129718 -227425 -70454\n"
+  "trace 1112000 66002 135862 -238777 -80368\n"
+  "trace 1120000 60776 142575 -222493 -71586\n"
+  "trace 1128000 54204 118953 -227971 -75984\n"
+  "trace 1136000 55840 123795 -228793 -56084\n"
+  "trace 1144000 65450 127830 -216727 -63030\n"
+  "trace 1152000 68021 143308 -247253 -80492\n"
+  "trace 1160000 12755 -208662 -23505 -247664\n"
+  "trace 1168000 3682 -207110 -8628 -244355\n"
+  "trace 1176000 -15501 -202909 -18700 -236061\n"
+  "trace 1184000 -6117 -226990 -8548 -228432\n"
+  "trace 1192000 14560 -227419 -14603 -220058\n"
+  "trace 1200000 106 -229759 -4178 -248390\n"
+  "trace 1208000 -15835 -227123 -4783 -217846\n"
+  "trace 1216000 10986 -212856 -16693 -235054\n"
+  "trace 1224000 14949 -230010 -12700 -243177\n"
+  "trace 1232000 11365 -208728 -15452 -225821\n"
+  "trace 1240000 11187 -214534 -27132 -234569\n"
+  "trace 1248000 13459 -217373 -14632 -233423\n"
+  "trace 1256000 -13908 -210474 339 -223318\n"
+  "trace 1264000 -9103 -207983 -10219 -249062\n"
+  "trace 1272000 -2907 -231815 -10196 -232430\n"
+  "trace 1280000 10568 199041 -275440 -144673\n"
+  "trace 1288000 15213 -212167 -4537 -246419\n"
+  "trace 1296000 3647 -208955 -6918 -245990\n"
+  "trace 1304000 -11836 -233015 -24097 -241251\n"
+  "trace 1312000 -5472 -227385 -156 -221452\n"
+  "trace 1320000 8038 -229687 -8684 -219104\n"
+  "trace 1328000 1714 -210103 -6397 -224688\n"
+  "trace 1336000 13234 -220564 -25386 -240808\n"
+  "trace 1344000 6965 -229211 -23062 -227398\n"
+  "trace 1352000 -13824 -207554 -8577 -227575\n"
+  "trace 1360000 -13952 -226618 -26567 -242692\n"
+  "trace 1368000 -13176 -212209 -19706 -226337\n"
+  "trace 1376000 8257 -210025 -7771 -226366\n"
+  "trace 1384000 -12302 -205823 -18728 -243167\n"
+  "trace 1392000 6355 -222557 -3429 -242602\n"
+  "trace 1400000 135552 104977 -246150 -33538\n"
+  "trace 1408000 138050 106039 -247236 -23299\n"
+  "trace 1416000 131547 113859 -220716 -10336\n"
+  "trace 1424000 128741 101523 -237072 -38883\n"
+  "trace 1432000 145031 113404 -241893 -13822\n"
+  "trace 1440000 126361 98650 -233822 -7133\n"
+  "trace 1448000 127972 93421 -225448 -20919\n"
+  "trace 1456000 141731 84746 -228454 -28441\n"
+  "trace 1464000 142313 93728 -246642 -34673\n"
+  "trace 1472000 146984 109725 -226577 -17011\n"
+  "trace 1480000 129379 103233 -247723 -18866\n"
+  "trace 1488000 143437 92893 -245648 -26116\n"
+  "trace 1496000 140780 93195 -232954 -26891\n"
+  "trace 1504000 126195 82918 -219093 -20090\n"
+  "trace 1512000 140405 83789 -235881 -8297\n"
+  "trace 1520000 119061 95414 -224117 -39261\n"
+  "trace 1528000 136816 109334 -222192 -35395\n"
+  "trace 1536000 138948 110828 -220636 -33317\n"
+  "trace 1544000 116643 89848 -220007 -10408\n"
+  "trace 1552000 134338 109726 -247018 -27716\n";
+
+static int count_mode(const motion_classifier::mode_t *modes, int from, int to, motion_classifier::mode_t mode)
+{
+  int count = 0;
+  for (int i = from; i < to; i++)
+  {
+    if (modes[i] == mode)
+    {
+      count++;
+    }
+  }
+  return count;
+}
+
+void test_parse()
+{
+  trace_sample sample;
+  TEST_ASSERT_TRUE(parse_trace_line("trace 1234 65536 -65536 0 131072", sample));
+  TEST_ASSERT_EQUAL_UINT32(1234, sample.micros);
+  TEST_ASSERT_EQUAL_INT32(-65536, sample.v[1]);
+  TEST_ASSERT_EQUAL_INT32(131072, sample.v[3]);
+  TEST_ASSERT_FALSE(parse_trace_line("Stage times (budget 8000 us, 0 overruns):", sample));
+}
+
+void test_twist_trace()
+{
+  motion_classifier::mode_t modes[100];
+  int count = replay(twist_trace, modes, 100);
+  TEST_ASSERT_EQUAL_INT(70, count);
+
+  // Rolling is pointer motion.
+  TEST_ASSERT_EQUAL_INT(20, count_mode(modes, 0, 20, motion_classifier::pointer));
+  // The twist switches to scrolling within a few samples, and the roll-like sample in the middle doesn't break it.
+  TEST_ASSERT_EQUAL_INT(27, count_mode(modes, 23, 50, motion_classifier::scroll));
+  // Once the lock runs out, rolling again goes back to pointer motion.
+  TEST_ASSERT_EQUAL_INT(10, count_mode(modes, 60, 70, motion_classifier::pointer));
+}
+
+#if defined(TRACE_FILE)
+void test_trace_file()
+{
+  FILE *file = fopen(TRACE_FILE, "rb");
+  TEST_ASSERT_TRUE_MESSAGE(file != NULL, "can't open " TRACE_FILE);
+  if (!file)
+  {
+    return;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *trace = (char *)malloc(size + 1);
+  size = long(fread(trace, 1, size, file));
+  trace[size] = 0;
+  fclose(file);
+
+  enum { max_samples = 1000000 };
+  motion_classifier::mode_t *modes = (motion_classifier::mode_t *)malloc(max_samples * sizeof(motion_classifier::mode_t));
+  int count = replay(trace, modes, max_samples);
+  int changes = 0;
+  for (int i = 1; i < count; i++)
+  {
+    if (modes[i] != modes[i - 1])
+    {
+      changes++;
+    }
+  }
+  printf("%s: %d samples, %d scrolling, %d mode changes\n", TRACE_FILE, count, count_mode(modes, 0, count, motion_classifier::scroll), changes);
+  free(modes);
+  free(trace);
+}
+#endif
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_parse);
+  RUN_TEST(test_twist_trace);
+#if defined(TRACE_FILE)
+  RUN_TEST(test_trace_file);
+#endif
+  return UNITY_END();
+}